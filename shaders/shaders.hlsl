@@ -13,8 +13,16 @@ cbuffer ConstantBuffer: register(b0)
     Light light;
 };
 
+struct Material
+{
+    float3 ambient;
+    float3 diffuse;
+    float3 emissive;
+};
+
 Texture2D g_texture : register(t0);
 texture2D g_shadow_map : register(t1);
+StructuredBuffer<Material> g_materials : register(t2);
 SamplerState g_sampler : register(s0);
 
 struct PSInput
@@ -26,22 +34,22 @@ struct PSInput
     float3 normal : NORMAL;
 };
 
-PSInput VSMain(float4 position : POSITION, float4 normal: NORMAL, float4 ambient : COLOR0, float4 diffuse : COLOR1,  float4 emissive : COLOR2, float4 textcoords : TEXCOORD)
+PSInput VSMain(float4 position : POSITION, float4 normal: NORMAL, float4 textcoords : TEXCOORD, uint material_id : MATERIAL)
 {
     PSInput result;
     result.position = mul(mwpMatrix, position);
-    result.color = ambient;
+    result.color = float4(g_materials[material_id].ambient, 1.f);
     result.uv = textcoords.xy;
     result.world_position = position.xyz;
     result.normal = normal.xyz;
     return result;
 }
 
-PSInput VSShadowMap(float4 position : POSITION, float4 normal: NORMAL, float4 ambient : COLOR0, float4 diffuse : COLOR1,  float4 emissive : COLOR2, float4 textcoords : TEXCOORD)
+PSInput VSShadowMap(float4 position : POSITION, float4 normal: NORMAL, float4 textcoords : TEXCOORD, uint material_id : MATERIAL)
 {
     PSInput result;
     result.position = mul(shadowMatrix, position);
-    result.color = ambient;
+    result.color = float4(g_materials[material_id].ambient, 1.f);
     result.uv = textcoords.xy;
     result.world_position = position.xyz;
     result.normal = normal.xyz;
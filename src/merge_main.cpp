@@ -0,0 +1,149 @@
+#include "renderer/raytracer/checkpoint.h"
+#include "renderer/raytracer/denoiser.h"
+#include "resource.h"
+#include "utils/error_handler.h"
+#include "utils/resource_utils.h"
+
+#include <cxxopts.hpp>
+#include <iostream>
+
+// Assembles checkpoints of region jobs into one image. Overlapping regions, e.g. the same window
+// rendered by several jobs with different seeds, have their samples combined
+int main(int argc, char** argv)
+{
+	try
+	{
+		cxxopts::Options options(argv[0], "Merges raytracer checkpoints into one image");
+
+		auto add_options = options.add_options();
+		add_options("result_path", "Path to the merged image", cxxopts::value<std::filesystem::path>()->default_value("result.png"));
+		add_options("denoise", "Filter the merged image", cxxopts::value<bool>()->default_value("false"));
+		add_options("denoise_iterations", "Passes of the denoising filter", cxxopts::value<unsigned>()->default_value("5"));
+		add_options("inputs", "Checkpoints to merge", cxxopts::value<std::vector<std::string>>());
+		add_options("h,help", "Print usage");
+		options.parse_positional({"inputs"});
+		options.positional_help("<checkpoint>...");
+
+		auto result = options.parse(argc, argv);
+		if (result.count("help") || !result.count("inputs"))
+		{
+			THROW_ERROR(options.help());
+		}
+
+		size_t width = 0;
+		size_t height = 0;
+		std::vector<float3> mean;
+		std::vector<float> m2;
+		std::vector<uint32_t> sample_count;
+		std::vector<float3> normal;
+		std::vector<float3> albedo;
+		std::vector<float> depth;
+		std::vector<cg::renderer::checkpoint_header> merged;
+
+		for (const auto& input : result["inputs"].as<std::vector<std::string>>())
+		{
+			auto checkpoint = cg::renderer::load_checkpoint(input);
+			const auto& header = checkpoint.header;
+			if (mean.empty())
+			{
+				width = header.width;
+				height = header.height;
+				mean.resize(width * height, float3(0.f));
+				m2.resize(width * height, 0.f);
+				sample_count.resize(width * height, 0);
+				normal.resize(width * height, float3(0.f));
+				albedo.resize(width * height, float3(0.f));
+				depth.resize(width * height, 0.f);
+			}
+			if (header.width != width || header.height != height)
+			{
+				THROW_ERROR("Checkpoint " + input + " belongs to an image of another size");
+			}
+			// Overlapping samples only converge when they are independent and drawn the same way
+			for (const auto& other : merged)
+			{
+				bool overlaps = header.region_x < other.region_x + other.region_width &&
+								other.region_x < header.region_x + header.region_width &&
+								header.region_y < other.region_y + other.region_height &&
+								other.region_y < header.region_y + header.region_height;
+				if (!overlaps)
+				{
+					continue;
+				}
+				if (header.seed == other.seed)
+				{
+					THROW_ERROR("Checkpoint " + input + " overlaps another one rendered with the same seed " + std::to_string(header.seed));
+				}
+				if (header.sampler_kind != other.sampler_kind)
+				{
+					THROW_ERROR("Checkpoint " + input + " overlaps another one rendered with a different sampler");
+				}
+			}
+			merged.push_back(header);
+
+			size_t i = 0;
+			for (size_t y = header.region_y; y < header.region_y + header.region_height; y++)
+			{
+				for (size_t x = header.region_x; x < header.region_x + header.region_width; x++, i++)
+				{
+					size_t pixel = y * width + x;
+					uint32_t count = checkpoint.sample_count[i];
+					cg::renderer::merge_mean(normal[pixel], sample_count[pixel], checkpoint.normal[i], count);
+					cg::renderer::merge_mean(albedo[pixel], sample_count[pixel], checkpoint.albedo[i], count);
+					cg::renderer::merge_mean(depth[pixel], sample_count[pixel], checkpoint.depth[i], count);
+					cg::renderer::merge_pixel(
+							mean[pixel], m2[pixel], sample_count[pixel],
+							checkpoint.mean[i], checkpoint.m2[i], checkpoint.sample_count[i]);
+				}
+			}
+			std::cout << "Merged " << input << " (" << header.region_width << "x" << header.region_height
+					  << " at " << header.region_x << "," << header.region_y << ")\n";
+		}
+
+		size_t missing = std::count(sample_count.begin(), sample_count.end(), 0u);
+		if (missing > 0)
+		{
+			std::cout << missing << " pixels have no samples and stay black\n";
+		}
+
+		cg::resource<float3> color(width, height);
+		for (size_t i = 0; i < color.count(); i++)
+		{
+			color.item(i) = mean[i];
+		}
+
+		if (result["denoise"].as<bool>())
+		{
+			cg::resource<float> variance(width, height);
+			cg::resource<float3> normal_guide(width, height);
+			cg::resource<float3> albedo_guide(width, height);
+			cg::resource<float> depth_guide(width, height);
+			for (size_t i = 0; i < color.count(); i++)
+			{
+				float luminance = cg::renderer::luminance(mean[i]);
+				variance.item(i) = sample_count[i] > 1 ? m2[i] / (sample_count[i] - 1) / sample_count[i] : luminance * luminance;
+				normal_guide.item(i) = normal[i];
+				albedo_guide.item(i) = albedo[i];
+				depth_guide.item(i) = depth[i];
+			}
+
+			cg::renderer::denoiser denoiser;
+			denoiser.settings.iterations = result["denoise_iterations"].as<unsigned>();
+			denoiser.denoise(color, variance, normal_guide, albedo_guide, depth_guide);
+		}
+
+		cg::resource<cg::unsigned_color> image(width, height);
+		for (size_t i = 0; i < image.count(); i++)
+		{
+			image.item(i) = cg::unsigned_color::from_float3(sqrt(color.item(i)));
+		}
+		cg::utils::save_resource(image, result["result_path"].as<std::filesystem::path>());
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
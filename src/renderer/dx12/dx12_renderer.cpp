@@ -273,8 +273,8 @@ D3D12_STATIC_SAMPLER_DESC cg::renderer::dx12_renderer::get_sampler_descriptor()
 
 void cg::renderer::dx12_renderer::create_root_signature(const D3D12_STATIC_SAMPLER_DESC* sampler_descriptors, UINT num_sampler_descriptors)
 {
-	CD3DX12_ROOT_PARAMETER1 root_parameters[3];
-	CD3DX12_DESCRIPTOR_RANGE1 ranges[3];
+	CD3DX12_ROOT_PARAMETER1 root_parameters[4];
+	CD3DX12_DESCRIPTOR_RANGE1 ranges[4];
 
 	ranges[0].Init(D3D12_DESCRIPTOR_RANGE_TYPE_CBV, 1, 0, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DATA_STATIC);
 	root_parameters[0].InitAsDescriptorTable(1, &ranges[0], D3D12_SHADER_VISIBILITY_ALL);
@@ -285,6 +285,10 @@ void cg::renderer::dx12_renderer::create_root_signature(const D3D12_STATIC_SAMPL
 	ranges[2].Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 1);
 	root_parameters[2].InitAsDescriptorTable(1, &ranges[2], D3D12_SHADER_VISIBILITY_PIXEL);
 
+	// Material table, looked up by the vertex shaders
+	ranges[3].Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 2, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DATA_STATIC);
+	root_parameters[3].InitAsDescriptorTable(1, &ranges[3], D3D12_SHADER_VISIBILITY_VERTEX);
+
 
 	D3D12_FEATURE_DATA_ROOT_SIGNATURE data{};
 	data.HighestVersion = D3D_ROOT_SIGNATURE_VERSION_1_1;
@@ -371,9 +375,7 @@ void cg::renderer::dx12_renderer::create_pso()
 		{"POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0},
 		{"NORMAL", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 12, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0},
 		{"TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 24, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0},
-		{"COLOR", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 32, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0},
-		{"COLOR", 1, DXGI_FORMAT_R32G32B32_FLOAT, 0, 44, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0},
-		{"COLOR", 2, DXGI_FORMAT_R32G32B32_FLOAT, 0, 56, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0},
+		{"MATERIAL", 0, DXGI_FORMAT_R32_UINT, 0, 32, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0},
 	};
 
 	D3D12_GRAPHICS_PIPELINE_STATE_DESC desc{};
@@ -514,6 +516,17 @@ void cg::renderer::dx12_renderer::create_shader_resource_view(const ComPtr<ID3D1
 	device->CreateShaderResourceView(texture.Get(), &srv_desc, cpu_handler);
 }
 
+void cg::renderer::dx12_renderer::create_structured_buffer_view(const ComPtr<ID3D12Resource>& buffer, UINT element_count, UINT element_size, D3D12_CPU_DESCRIPTOR_HANDLE cpu_handler)
+{
+	D3D12_SHADER_RESOURCE_VIEW_DESC srv_desc{};
+	srv_desc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+	srv_desc.Format = DXGI_FORMAT_UNKNOWN;
+	srv_desc.ViewDimension = D3D12_SRV_DIMENSION_BUFFER;
+	srv_desc.Buffer.NumElements = element_count;
+	srv_desc.Buffer.StructureByteStride = element_size;
+	device->CreateShaderResourceView(buffer.Get(), &srv_desc, cpu_handler);
+}
+
 void cg::renderer::dx12_renderer::create_constant_buffer_view(const ComPtr<ID3D12Resource>& buffer, D3D12_CPU_DESCRIPTOR_HANDLE cpu_handler)
 {
 	D3D12_CONSTANT_BUFFER_VIEW_DESC desc{};
@@ -532,7 +545,8 @@ void cg::renderer::dx12_renderer::load_assets()
 
 	const size_t shape_num = model->get_index_buffers().size();
 
-	cbv_srv_heap.create_heap(device, D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, 3 + shape_num, D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE);
+	// Constant buffer, null texture, shadow map, a texture per shape and the material table
+	cbv_srv_heap.create_heap(device, D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, 4 + shape_num, D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE);
 
 	upload_vertex_buffers.resize(shape_num);
 	vertex_buffers.resize(shape_num);
@@ -613,6 +627,16 @@ void cg::renderer::dx12_renderer::load_assets()
 
 	}
 
+	// Material table, vertices carry an index into it
+	const auto& materials = model->get_materials();
+	const UINT materials_size = static_cast<UINT>(materials.size() * sizeof(cg::material));
+	create_resource_on_default_heap(material_buffer, materials_size, L"Material buffer");
+	create_resource_on_upload_heap(upload_material_buffer, materials_size, L"Material buffer");
+	copy_data(materials.data(), materials_size, material_buffer,
+		upload_material_buffer, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
+	create_structured_buffer_view(material_buffer, static_cast<UINT>(materials.size()), sizeof(cg::material),
+		cbv_srv_heap.get_cpu_descriptor_handle(static_cast<UINT>(3 + shape_num)));
+
 	// Constant buffer has fixed size of 64 Kbyte
 	std::wstring cb_name(L"Constant buffer");
 	create_resource_on_upload_heap(constant_buffer, 64*1024, cb_name);
@@ -668,6 +692,8 @@ void cg::renderer::dx12_renderer::populate_command_list()
 	command_list->SetDescriptorHeaps(_countof(heaps), heaps);
 	command_list->SetGraphicsRootDescriptorTable(0, cbv_srv_heap.get_gpu_descriptor_handle(0));
 	command_list->SetGraphicsRootDescriptorTable(2, cbv_srv_heap.get_gpu_descriptor_handle(1));
+	command_list->SetGraphicsRootDescriptorTable(3, cbv_srv_heap.get_gpu_descriptor_handle(
+		static_cast<UINT>(3 + model->get_index_buffers().size())));
 	command_list->RSSetScissorRects(1, &scissor_rect);
 	command_list->RSSetViewports(1, &view_port);
 
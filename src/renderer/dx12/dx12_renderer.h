@@ -88,6 +88,9 @@ namespace cg::renderer
 		std::vector<ComPtr<ID3D12Resource>> textures;
 		std::vector<ComPtr<ID3D12Resource>> upload_textures;
 
+		ComPtr<ID3D12Resource> material_buffer;
+		ComPtr<ID3D12Resource> upload_material_buffer;
+
 		ComPtr<ID3D12Resource> depth_buffer;
 
 		ComPtr<ID3D12Resource> shadow_map;
@@ -123,6 +126,7 @@ namespace cg::renderer
 		void create_render_target_views();
 		static D3D12_VERTEX_BUFFER_VIEW create_vertex_buffer_view(const ComPtr<ID3D12Resource>& vertex_buffer, UINT vertex_buffer_size);
 		static D3D12_INDEX_BUFFER_VIEW create_index_buffer_view(const ComPtr<ID3D12Resource>& index_buffer, UINT index_buffer_size);
+		void create_structured_buffer_view(const ComPtr<ID3D12Resource>& buffer, UINT element_count, UINT element_size, D3D12_CPU_DESCRIPTOR_HANDLE cpu_handler);
 		void create_constant_buffer_view(const ComPtr<ID3D12Resource>& buffer, D3D12_CPU_DESCRIPTOR_HANDLE cpu_handler);
 
 		void create_root_signature(const D3D12_STATIC_SAMPLER_DESC* sampler_descriptors, UINT num_sampler_descriptors);
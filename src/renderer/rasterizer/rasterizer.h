@@ -33,6 +33,9 @@ namespace cg::renderer
 		void set_viewport(size_t in_width, size_t in_height);
 
 		void draw(size_t num_vertexes, size_t vertex_offset);
+		// Same as `draw`, but shaders are plain callables, so they inline into the per-pixel loop
+		template<typename VS, typename PS>
+		void draw(size_t num_vertexes, size_t vertex_offset, const VS& in_vertex_shader, const PS& in_pixel_shader);
 
 		void analyzeVertices(const std::vector<int2>& vertices);
 
@@ -111,19 +114,28 @@ namespace cg::renderer
 	}
 
 
-	// Modified to show actual figure's edges and vertices
 	template<typename VB, typename RT>
 	inline void rasterizer<VB, RT>::draw(size_t num_vertexes, size_t vertex_offset)
+	{
+		draw(num_vertexes, vertex_offset, vertex_shader, pixel_shader);
+	}
+
+	// Modified to show actual figure's edges and vertices
+	template<typename VB, typename RT>
+	template<typename VS, typename PS>
+	inline void rasterizer<VB, RT>::draw(
+			size_t num_vertexes, size_t vertex_offset, const VS& in_vertex_shader, const PS& in_pixel_shader)
 	{
 		// Vector for storing all vertices
 		std::vector<int2> rendered_vertices;
+		rendered_vertices.reserve(num_vertexes);
 
 		size_t vertex_id = vertex_offset;
 		while (vertex_id < vertex_offset + num_vertexes)
 		{
 			// Vector transform
 
-			std::vector<VB> vertices(3);
+			VB vertices[3];
 			vertices[0] = vertex_buffer->item(index_buffer->item(vertex_id++));
 			vertices[1] = vertex_buffer->item(index_buffer->item(vertex_id++));
 			vertices[2] = vertex_buffer->item(index_buffer->item(vertex_id++));
@@ -132,7 +144,7 @@ namespace cg::renderer
 			for (int i = 0; i < 3; i++) {
 				auto& vertex = vertices[i];
 				float4 coords{vertex.v.x, vertex.v.y, vertex.v.z, 1.f};
-				auto processed = vertex_shader(coords, vertex);
+				auto processed = in_vertex_shader(coords, vertex);
 
 				vertex.v.x = processed.first.x / processed.first.w;
 				vertex.v.y = processed.first.y / processed.first.w;
@@ -172,20 +184,28 @@ namespace cg::renderer
 			float eps = 1e-2;
 
 			float edge = static_cast<float>(edge_function(vertex_a, vertex_b, vertex_c));
-			
 
-			for (int x = min_aabb.x; x <= max_aabb.x; x++) {
-				for (int y = min_aabb.y; y <= max_aabb.y; y++) {
-					int2 point(x, y);
-					
-					float u = static_cast<float>(edge_function(vertex_b, vertex_c, point)) / edge;
-					float v = static_cast<float>(edge_function(vertex_c, vertex_a, point)) / edge;
-					float w = static_cast<float>(edge_function(vertex_a, vertex_b, point)) / edge;
+			// Edge functions change by a constant step between neighbouring pixels,
+			// so the inner loop only adds integers instead of calling `edge_function`
+			int3 row_edges(
+				edge_function(vertex_b, vertex_c, min_aabb),
+				edge_function(vertex_c, vertex_a, min_aabb),
+				edge_function(vertex_a, vertex_b, min_aabb));
+			int3 step_x(vertex_c.y - vertex_b.y, vertex_a.y - vertex_c.y, vertex_b.y - vertex_a.y);
+			int3 step_y(vertex_b.x - vertex_c.x, vertex_c.x - vertex_a.x, vertex_a.x - vertex_b.x);
+
+			// Rows go in memory order of the render target
+			for (int y = min_aabb.y; y <= max_aabb.y; y++, row_edges += step_y) {
+				int3 edges = row_edges;
+				for (int x = min_aabb.x; x <= max_aabb.x; x++, edges += step_x) {
+					float u = static_cast<float>(edges.x) / edge;
+					float v = static_cast<float>(edges.y) / edge;
+					float w = static_cast<float>(edges.z) / edge;
 
 					if (u >= 0.f && v >= 0.f && w >= 0.f) {
 						float depth = u * vertices[0].v.z + v * vertices[1].v.z + w * vertices[2].v.z;
 						if (depth_test(depth, x, y)) {
-							auto result = pixel_shader(vertices[0], depth);
+							auto result = in_pixel_shader(vertices[0], depth);
 
 							// If edge, draw with special color, else use material
 							if (u < eps || v < eps || w < eps) {
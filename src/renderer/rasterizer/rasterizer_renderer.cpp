@@ -26,14 +26,16 @@ void cg::renderer::rasterization_renderer::render()
 	);
 
 	// This is how lambda function in C++ looks like :)
+	// They are passed to `draw` directly, so the per-pixel loop calls them without std::function
 
-	rasterizer->vertex_shader = [&](float4 vertex, cg::vertex vertex_data) {
+	auto vertex_shader = [&](float4 vertex, const cg::vertex& vertex_data) {
 		auto processed = mul(matrix, vertex);
 		return std::make_pair(processed, vertex_data);
 	};
 
-	rasterizer->pixel_shader = [](cg::vertex data, float z) {
-		return cg::color::from_float3(data.ambient);
+	const auto& materials = model->get_materials();
+	auto pixel_shader = [&](const cg::vertex& data, float z) {
+		return cg::color::from_float3(materials[data.material_id].ambient);
 	};
 
 	{
@@ -50,7 +52,7 @@ void cg::renderer::rasterization_renderer::render()
 	for (size_t shape_id = 0; shape_id < model->get_index_buffers().size(); shape_id++) {
 		rasterizer->set_vertex_buffer(model->get_vertex_buffers()[shape_id]);
 		rasterizer->set_index_buffer(model->get_index_buffers()[shape_id]);
-		rasterizer->draw(model->get_index_buffers()[shape_id]->count(), 0);
+		rasterizer->draw(model->get_index_buffers()[shape_id]->count(), 0, vertex_shader, pixel_shader);
 	}
 
 	cg::utils::save_resource(*render_target, settings->result_path);
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace cg::renderer
+{
+	// Leading bytes of an acceleration structure cache file, followed by every mesh hierarchy.
+	// The key hashes everything the hierarchies are built from, so a file is only read back
+	// for the same geometry, build settings and build of the program
+	struct acceleration_cache_header
+	{
+		char magic[4] = {'C', 'G', 'A', 'S'};
+		uint32_t version = 4;
+		uint64_t key = 0;
+		uint32_t mesh_count = 0;
+	};
+
+	// Fields are stored one by one, so the padding of the struct never reaches the file
+	inline void write_header(std::ostream& stream, const acceleration_cache_header& header)
+	{
+		stream.write(header.magic, sizeof(header.magic));
+		stream.write(reinterpret_cast<const char*>(&header.version), sizeof(header.version));
+		stream.write(reinterpret_cast<const char*>(&header.key), sizeof(header.key));
+		stream.write(reinterpret_cast<const char*>(&header.mesh_count), sizeof(header.mesh_count));
+	}
+
+	inline bool read_header(std::istream& stream, acceleration_cache_header& header)
+	{
+		stream.read(header.magic, sizeof(header.magic));
+		stream.read(reinterpret_cast<char*>(&header.version), sizeof(header.version));
+		stream.read(reinterpret_cast<char*>(&header.key), sizeof(header.key));
+		stream.read(reinterpret_cast<char*>(&header.mesh_count), sizeof(header.mesh_count));
+		return static_cast<bool>(stream);
+	}
+
+	static constexpr uint64_t HASH_OFFSET_BASIS = 14695981039346656037ull;
+
+	// 64-bit FNV-1a, continues from `hash` so several buffers make one key
+	inline uint64_t hash_bytes(const void* data, size_t size, uint64_t hash = HASH_OFFSET_BASIS)
+	{
+		const auto* bytes = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < size; i++) {
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		}
+		return hash;
+	}
+
+	template<typename T>
+	inline uint64_t hash_value(const T& value, uint64_t hash = HASH_OFFSET_BASIS)
+	{
+		static_assert(std::is_trivially_copyable_v<T>, "Only plain data can be hashed by bytes");
+		return hash_bytes(&value, sizeof(T), hash);
+	}
+
+	inline std::string to_hex(uint64_t value)
+	{
+		char text[17];
+		std::snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(value));
+		return text;
+	}
+
+	// Arrays are stored as their size followed by raw items
+	template<typename T>
+	inline void write_array(std::ostream& stream, const std::vector<T>& items)
+	{
+		static_assert(std::is_trivially_copyable_v<T>, "Only plain data can be cached");
+		uint64_t count = items.size();
+		stream.write(reinterpret_cast<const char*>(&count), sizeof(count));
+		stream.write(reinterpret_cast<const char*>(items.data()), count * sizeof(T));
+	}
+
+	// Reads the whole array at once. Returns false on a short or damaged stream
+	template<typename T>
+	inline bool read_array(std::istream& stream, std::vector<T>& items)
+	{
+		static_assert(std::is_trivially_copyable_v<T>, "Only plain data can be cached");
+		uint64_t count = 0;
+		if (!stream.read(reinterpret_cast<char*>(&count), sizeof(count))) {
+			return false;
+		}
+		// A damaged size must not turn into a huge allocation
+		auto position = stream.tellg();
+		stream.seekg(0, std::ios::end);
+		auto remaining = static_cast<uint64_t>(stream.tellg() - position);
+		stream.seekg(position);
+		if (count > remaining / sizeof(T)) {
+			return false;
+		}
+		items.resize(count);
+		return static_cast<bool>(stream.read(reinterpret_cast<char*>(items.data()), count * sizeof(T)));
+	}
+}// namespace cg::renderer
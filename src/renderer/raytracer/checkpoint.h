@@ -0,0 +1,137 @@
+#pragma once
+
+#include "renderer/raytracer/luminance.h"
+#include "utils/error_handler.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <linalg.h>
+#include <vector>
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+	// Leading bytes of a checkpoint file, followed by the mean color, the luminance M2, the sample count,
+	// the mean normal, albedo and depth of primary hits and the shape and primitive IDs of every pixel
+	// of the region, row by row
+	struct checkpoint_header
+	{
+		char magic[4] = {'C', 'G', 'C', 'K'};
+		uint32_t version = 4;
+		// Size of the whole image
+		uint32_t width = 0;
+		uint32_t height = 0;
+		// Part of the image stored in the file
+		uint32_t region_x = 0;
+		uint32_t region_y = 0;
+		uint32_t region_width = 0;
+		uint32_t region_height = 0;
+		uint32_t frame_count = 0;
+		uint32_t seed = 0;
+		uint32_t sampler_kind = 0;
+	};
+
+	// Accumulated samples of one region of an image, written by the raytracer and read back by
+	// the raytracer on resume or by the merge tool
+	struct checkpoint
+	{
+		checkpoint_header header;
+		std::vector<float3> mean;
+		std::vector<float> m2;
+		std::vector<uint32_t> sample_count;
+		std::vector<float3> normal;
+		std::vector<float3> albedo;
+		std::vector<float> depth;
+		std::vector<uint2> id;
+	};
+
+	// Running mean of any per-sample value, call before `merge_pixel` updates `count`
+	template<typename T>
+	inline void merge_mean(T& mean, uint32_t count, const T& other_mean, uint32_t other_count)
+	{
+		if (other_count > 0) {
+			mean += (other_mean - mean) * (static_cast<float>(other_count) / (count + other_count));
+		}
+	}
+
+	// Folds samples of `other` into a pixel of `mean`, `m2` and `count` (Chan et al. parallel variance)
+	inline void merge_pixel(float3& mean, float& m2, uint32_t& count, const float3& other_mean, float other_m2, uint32_t other_count)
+	{
+		if (other_count == 0) {
+			return;
+		}
+		uint32_t total = count + other_count;
+		float3 delta = other_mean - mean;
+		float luminance_delta = luminance(delta);
+		mean += delta * (static_cast<float>(other_count) / total);
+		m2 += other_m2 + luminance_delta * luminance_delta * (static_cast<float>(count) * other_count / total);
+		count = total;
+	}
+
+	inline void save_checkpoint(const checkpoint& checkpoint, const std::filesystem::path& path)
+	{
+		// Written next to the old checkpoint and renamed over it, so a killed process never leaves a torn file
+		auto temporary_path = path;
+		temporary_path += ".tmp";
+		{
+			std::ofstream file(temporary_path, std::ios::binary);
+			if (!file) {
+				THROW_ERROR("Can't write checkpoint " + temporary_path.string());
+			}
+			file.write(reinterpret_cast<const char*>(&checkpoint.header), sizeof(checkpoint.header));
+			file.write(reinterpret_cast<const char*>(checkpoint.mean.data()), checkpoint.mean.size() * sizeof(float3));
+			file.write(reinterpret_cast<const char*>(checkpoint.m2.data()), checkpoint.m2.size() * sizeof(float));
+			file.write(reinterpret_cast<const char*>(checkpoint.sample_count.data()), checkpoint.sample_count.size() * sizeof(uint32_t));
+			file.write(reinterpret_cast<const char*>(checkpoint.normal.data()), checkpoint.normal.size() * sizeof(float3));
+			file.write(reinterpret_cast<const char*>(checkpoint.albedo.data()), checkpoint.albedo.size() * sizeof(float3));
+			file.write(reinterpret_cast<const char*>(checkpoint.depth.data()), checkpoint.depth.size() * sizeof(float));
+			file.write(reinterpret_cast<const char*>(checkpoint.id.data()), checkpoint.id.size() * sizeof(uint2));
+			if (!file) {
+				THROW_ERROR("Can't write checkpoint " + temporary_path.string());
+			}
+		}
+		std::filesystem::rename(temporary_path, path);
+	}
+
+	inline checkpoint load_checkpoint(const std::filesystem::path& path)
+	{
+		std::ifstream file(path, std::ios::binary);
+		if (!file) {
+			THROW_ERROR("Can't open checkpoint " + path.string());
+		}
+
+		checkpoint result;
+		checkpoint_header expected;
+		auto& header = result.header;
+		file.read(reinterpret_cast<char*>(&header), sizeof(header));
+		if (!file || !std::equal(header.magic, header.magic + 4, expected.magic) || header.version != expected.version) {
+			THROW_ERROR("Not a checkpoint: " + path.string());
+		}
+		if (header.region_x + header.region_width > header.width || header.region_y + header.region_height > header.height) {
+			THROW_ERROR("Checkpoint region lies outside of the image: " + path.string());
+		}
+
+		size_t count = static_cast<size_t>(header.region_width) * header.region_height;
+		result.mean.resize(count);
+		result.m2.resize(count);
+		result.sample_count.resize(count);
+		result.normal.resize(count);
+		result.albedo.resize(count);
+		result.depth.resize(count);
+		result.id.resize(count);
+		file.read(reinterpret_cast<char*>(result.mean.data()), count * sizeof(float3));
+		file.read(reinterpret_cast<char*>(result.m2.data()), count * sizeof(float));
+		file.read(reinterpret_cast<char*>(result.sample_count.data()), count * sizeof(uint32_t));
+		file.read(reinterpret_cast<char*>(result.normal.data()), count * sizeof(float3));
+		file.read(reinterpret_cast<char*>(result.albedo.data()), count * sizeof(float3));
+		file.read(reinterpret_cast<char*>(result.depth.data()), count * sizeof(float));
+		file.read(reinterpret_cast<char*>(result.id.data()), count * sizeof(uint2));
+		if (!file) {
+			THROW_ERROR("Checkpoint is truncated: " + path.string());
+		}
+		return result;
+	}
+}// namespace cg::renderer
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "renderer/raytracer/luminance.h"
+#include "resource.h"
+#include "utils/tile_scheduler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <linalg.h>
+#include <omp.h>
+#include <vector>
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+	struct denoiser_settings
+	{
+		// Every iteration doubles the footprint of the 5x5 kernel
+		unsigned iterations = 5;
+		// Luminance differences are measured in standard deviations of the pixel's noise
+		float luminance_sigma = 4.f;
+		// Exponent of the normal cosine, higher keeps creases sharper
+		float normal_power = 64.f;
+		float albedo_sigma = 0.1f;
+		// Relative depth difference, grows with the distance between pixels
+		float depth_sigma = 0.02f;
+		size_t tile_size = 32;
+	};
+
+	// Edge-avoiding a-trous wavelet filter from "Edge-Avoiding A-Trous Wavelet Transform for fast
+	// Global Illumination Filtering" by Dammertz et al., with the variance-guided luminance weight of SVGF.
+	// Guides come from primary hits: pixels with zero depth saw no surface and are only mixed with each other
+	class denoiser
+	{
+	public:
+		denoiser_settings settings;
+
+		// Filters `color` in place, the other buffers are read only. `variance` holds the variance
+		// of every pixel's mean luminance
+		void denoise(cg::resource<float3>& color, const cg::resource<float>& variance,
+					 const cg::resource<float3>& normal, const cg::resource<float3>& albedo,
+					 const cg::resource<float>& depth) const;
+
+	protected:
+		struct guide
+		{
+			float3 normal;
+			float3 albedo;
+			float depth;
+		};
+
+		float edge_weight(const guide& center, const guide& other, float center_luminance, float other_luminance,
+						  float luminance_scale, int step) const;
+	};
+
+	inline void denoiser::denoise(cg::resource<float3>& color, const cg::resource<float>& variance,
+								  const cg::resource<float3>& normal, const cg::resource<float3>& albedo,
+								  const cg::resource<float>& depth) const
+	{
+		int width = static_cast<int>(color.get_stride());
+		int height = static_cast<int>(color.count()) / width;
+		size_t count = color.count();
+
+		std::vector<guide> guides(count);
+		std::vector<float3> colors(count);
+		std::vector<float> variances(count);
+		for (size_t i = 0; i < count; i++) {
+			guides[i] = {normal.item(i), albedo.item(i), depth.item(i)};
+			colors[i] = color.item(i);
+			variances[i] = variance.item(i);
+		}
+		std::vector<float3> next_colors(count);
+		std::vector<float> next_variances(count);
+
+		constexpr float kernel[3] = {3.f / 8.f, 1.f / 4.f, 1.f / 16.f};
+
+		int tile = static_cast<int>(std::max<size_t>(settings.tile_size, 1));
+		int tiles_x = (width + tile - 1) / tile;
+		int tiles_y = (height + tile - 1) / tile;
+
+		for (unsigned iteration = 0; iteration < settings.iterations; iteration++) {
+			int step = 1 << iteration;
+			cg::utils::tile_scheduler scheduler(tiles_x * tiles_y, omp_get_max_threads());
+
+			#pragma omp parallel
+			{
+				size_t tile_id;
+				while (scheduler.next_tile(omp_get_thread_num(), tile_id)) {
+					int tile_x = static_cast<int>(tile_id % tiles_x) * tile;
+					int tile_y = static_cast<int>(tile_id / tiles_x) * tile;
+					for (int y = tile_y; y < std::min(tile_y + tile, height); y++) {
+						for (int x = tile_x; x < std::min(tile_x + tile, width); x++) {
+							size_t center = y * width + x;
+							float center_luminance = luminance(colors[center]);
+							// Pixels with a single sample have no variance estimate and rely on the guides alone
+							float luminance_scale = settings.luminance_sigma * std::sqrt(std::max(variances[center], 0.f)) + 1e-4f;
+
+							float3 color_sum = colors[center] * (kernel[0] * kernel[0]);
+							float variance_sum = variances[center] * (kernel[0] * kernel[0]) * (kernel[0] * kernel[0]);
+							float weight_sum = kernel[0] * kernel[0];
+
+							for (int dy = -2; dy <= 2; dy++) {
+								int sample_y = y + dy * step;
+								if (sample_y < 0 || sample_y >= height) {
+									continue;
+								}
+								for (int dx = -2; dx <= 2; dx++) {
+									int sample_x = x + dx * step;
+									if ((dx == 0 && dy == 0) || sample_x < 0 || sample_x >= width) {
+										continue;
+									}
+									size_t other = sample_y * width + sample_x;
+									float weight = kernel[std::abs(dx)] * kernel[std::abs(dy)] *
+										edge_weight(guides[center], guides[other], center_luminance,
+													luminance(colors[other]), luminance_scale, step);
+									color_sum += colors[other] * weight;
+									variance_sum += variances[other] * weight * weight;
+									weight_sum += weight;
+								}
+							}
+
+							next_colors[center] = color_sum / weight_sum;
+							next_variances[center] = variance_sum / (weight_sum * weight_sum);
+						}
+					}
+				}
+			}
+
+			colors.swap(next_colors);
+			variances.swap(next_variances);
+		}
+
+		for (size_t i = 0; i < count; i++) {
+			color.item(i) = colors[i];
+		}
+	}
+
+	inline float denoiser::edge_weight(const guide& center, const guide& other, float center_luminance,
+									   float other_luminance, float luminance_scale, int step) const
+	{
+		bool center_hit = center.depth > 0.f;
+		bool other_hit = other.depth > 0.f;
+		if (center_hit != other_hit) {
+			return 0.f;
+		}
+
+		float weight = std::exp(-std::abs(center_luminance - other_luminance) / luminance_scale);
+		if (!center_hit) {
+			return weight;
+		}
+
+		float cosine = std::max(dot(center.normal, other.normal), 0.f);
+		weight *= std::pow(cosine, settings.normal_power);
+
+		float3 albedo_difference = center.albedo - other.albedo;
+		weight *= std::exp(-dot(albedo_difference, albedo_difference) / (settings.albedo_sigma * settings.albedo_sigma));
+
+		float depth_tolerance = settings.depth_sigma * step * std::max(center.depth, other.depth);
+		weight *= std::exp(-std::abs(center.depth - other.depth) / depth_tolerance);
+		return weight;
+	}
+}// namespace cg::renderer
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <linalg.h>
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+	// Perceived brightness of a linear color with Rec. 709 weights
+	inline float luminance(const float3& color)
+	{
+		return dot(color, float3(0.2126f, 0.7152f, 0.0722f));
+	}
+}// namespace cg::renderer
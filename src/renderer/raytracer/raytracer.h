@@ -1,12 +1,41 @@
 #pragma once
 
 #include "resource.h"
-
+#include "renderer/raytracer/acceleration_cache.h"
+#include "renderer/raytracer/checkpoint.h"
+#include "renderer/raytracer/denoiser.h"
+#include "renderer/raytracer/luminance.h"
+#include "renderer/raytracer/sampler.h"
+#include "renderer/raytracer/sampling.h"
+#include "utils/tile_scheduler.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <linalg.h>
 #include <memory>
+#include <numeric>
 #include <omp.h>
-#include <random>
+#include <optional>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RAYTRACER_SSE
+#endif
+#if defined(__AVX2__)
+#define RAYTRACER_AVX2
+#endif
+#if defined(RAYTRACER_SSE) || defined(RAYTRACER_AVX2)
+#include <immintrin.h>
+#endif
+// Tasks came with OpenMP 3.0, MSVC's /openmp is 2.0 and builds the BVH on one thread
+#if defined(_OPENMP) && _OPENMP >= 200805
+#define RAYTRACER_OMP_TASKS 1
+#else
+#define RAYTRACER_OMP_TASKS 0
+#endif
 
 using namespace linalg::aliases;
 
@@ -14,24 +43,145 @@ namespace cg::renderer
 {
 	struct ray
 	{
+		ray() = default;
 		ray(float3 position, float3 direction) : position(position)
 		{
 			this->direction = normalize(direction);
+			inv_direction = float3(1.f) / this->direction;
 		}
 		float3 position;
 		float3 direction;
+		// Computed once per ray and shared by every box test
+		float3 inv_direction;
+	};
+
+	// Returns the distance to the entry point or infinity if the box is missed
+	inline float slab_test(const ray& ray, const float3& aabb_min, const float3& aabb_max, float max_t)
+	{
+		float3 t0 = (aabb_max - ray.position) * ray.inv_direction;
+		float3 t1 = (aabb_min - ray.position) * ray.inv_direction;
+		float3 tmax = max(t0, t1);
+		float3 tmin = min(t0, t1);
+		float t_enter = std::max(maxelem(tmin), 0.f);
+		float t_exit = std::min(minelem(tmax), max_t);
+		if (t_enter > t_exit) {
+			return std::numeric_limits<float>::infinity();
+		}
+		return t_enter;
+	}
+
+	// Rays of a pixel block in SoA layout for tests of several rays against one box
+	template<size_t P>
+	struct ray_packet
+	{
+		static_assert(P % 4 == 0, "Packets are processed in groups of 4 rays");
+
+		explicit ray_packet(const ray* rays);
+
+		alignas(16) float position_x[P];
+		alignas(16) float position_y[P];
+		alignas(16) float position_z[P];
+		alignas(16) float inv_direction_x[P];
+		alignas(16) float inv_direction_y[P];
+		alignas(16) float inv_direction_z[P];
+		// All rays point into the same octant, so they agree on the order of children
+		bool coherent = true;
 	};
 
+	template<size_t P>
+	inline ray_packet<P>::ray_packet(const ray* rays)
+	{
+		for (size_t i = 0; i < P; i++) {
+			position_x[i] = rays[i].position.x;
+			position_y[i] = rays[i].position.y;
+			position_z[i] = rays[i].position.z;
+			inv_direction_x[i] = rays[i].inv_direction.x;
+			inv_direction_y[i] = rays[i].inv_direction.y;
+			inv_direction_z[i] = rays[i].inv_direction.z;
+
+			coherent = coherent &&
+				(rays[i].direction.x < 0.f) == (rays[0].direction.x < 0.f) &&
+				(rays[i].direction.y < 0.f) == (rays[0].direction.y < 0.f) &&
+				(rays[i].direction.z < 0.f) == (rays[0].direction.z < 0.f);
+		}
+	}
+
+	// Tests every ray of a packet against one box. Returns a mask of rays which enter it
+	// before their `max_t` and the nearest entry distance among them
+	template<size_t P>
+	inline unsigned packet_slab_test(
+			const ray_packet<P>& packet, const float3& aabb_min, const float3& aabb_max, const float* max_t, float& t_nearest)
+	{
+		unsigned mask = 0;
+		t_nearest = std::numeric_limits<float>::infinity();
+#ifdef RAYTRACER_SSE
+		__m128 min_x = _mm_set1_ps(aabb_min.x), min_y = _mm_set1_ps(aabb_min.y), min_z = _mm_set1_ps(aabb_min.z);
+		__m128 max_x = _mm_set1_ps(aabb_max.x), max_y = _mm_set1_ps(aabb_max.y), max_z = _mm_set1_ps(aabb_max.z);
+		for (size_t i = 0; i < P; i += 4) {
+			__m128 tmin = _mm_setzero_ps();
+			__m128 tmax = _mm_loadu_ps(max_t + i);
+
+			auto slab = [&](__m128 plane_min, __m128 plane_max, const float* position, const float* inv_direction) {
+				__m128 p = _mm_load_ps(position + i);
+				__m128 inv = _mm_load_ps(inv_direction + i);
+				__m128 t0 = _mm_mul_ps(_mm_sub_ps(plane_min, p), inv);
+				__m128 t1 = _mm_mul_ps(_mm_sub_ps(plane_max, p), inv);
+				tmin = _mm_max_ps(tmin, _mm_min_ps(t0, t1));
+				tmax = _mm_min_ps(tmax, _mm_max_ps(t0, t1));
+			};
+			slab(min_x, max_x, packet.position_x, packet.inv_direction_x);
+			slab(min_y, max_y, packet.position_y, packet.inv_direction_y);
+			slab(min_z, max_z, packet.position_z, packet.inv_direction_z);
+
+			unsigned group = static_cast<unsigned>(_mm_movemask_ps(_mm_cmple_ps(tmin, tmax)));
+			if (!group) {
+				continue;
+			}
+			mask |= group << i;
+
+			alignas(16) float t_enter[4];
+			_mm_store_ps(t_enter, tmin);
+			for (size_t lane = 0; lane < 4; lane++) {
+				if (group & (1u << lane)) {
+					t_nearest = std::min(t_nearest, t_enter[lane]);
+				}
+			}
+		}
+#else
+		for (size_t i = 0; i < P; i++) {
+			float3 position(packet.position_x[i], packet.position_y[i], packet.position_z[i]);
+			float3 inv_direction(packet.inv_direction_x[i], packet.inv_direction_y[i], packet.inv_direction_z[i]);
+			float3 t0 = (aabb_min - position) * inv_direction;
+			float3 t1 = (aabb_max - position) * inv_direction;
+			float t_enter = std::max(maxelem(min(t0, t1)), 0.f);
+			float t_exit = std::min(minelem(max(t0, t1)), max_t[i]);
+			if (t_enter <= t_exit) {
+				mask |= 1u << i;
+				t_nearest = std::min(t_nearest, t_enter);
+			}
+		}
+#endif
+		return mask;
+	}
+
+	static constexpr uint32_t PRIMITIVE_NONE = std::numeric_limits<uint32_t>::max();
+
 	struct payload
 	{
 		float t;
 		float3 bary;
 		cg::color color;
+		// Emission of the hit surface, already a part of `color`
+		float3 emitted;
+		// Hit triangle, PRIMITIVE_NONE if nothing was hit
+		uint32_t instance_id = 0;
+		uint32_t primitive_id = PRIMITIVE_NONE;
 	};
 
 	template<typename VB>
 	struct triangle
 	{
+		triangle() = default;
 		triangle(const VB& vertex_a, const VB& vertex_b, const VB& vertex_c);
 
 		float3 a;
@@ -45,9 +195,12 @@ namespace cg::renderer
 		float3 nb;
 		float3 nc;
 
-		float3 ambient;
-		float3 diffuse;
-		float3 emissive;
+		// Index in the material table given to the raytracer
+		uint32_t material_id = 0;
+
+		// Where the triangle came from: index of its shape and its index within the shape
+		uint32_t shape_id = 0;
+		uint32_t primitive_id = 0;
 	};
 
 	template<typename VB>
@@ -65,25 +218,475 @@ namespace cg::renderer
 		nb = vertex_b.n;
 		nc = vertex_c.n;
 		
-		ambient = vertex_a.ambient;
-		diffuse = vertex_a.diffuse;
-		emissive = vertex_a.emissive;
+		material_id = vertex_a.material_id;
 
 	}
 
+	// Part of a triangle needed only once its hit is found. Kept apart from the intersection data,
+	// so traversal doesn't pull normals and materials through the cache
+	struct triangle_shading
+	{
+		triangle_shading() = default;
+		template<typename VB>
+		explicit triangle_shading(const triangle<VB>& triangle);
+
+		float3 na;
+		float3 nb;
+		float3 nc;
+
+		uint32_t material_id = 0;
+		uint32_t shape_id = 0;
+		uint32_t primitive_id = 0;
+	};
+
 	template<typename VB>
-	class aabb
+	inline triangle_shading::triangle_shading(const triangle<VB>& triangle) :
+		na(triangle.na), nb(triangle.nb), nc(triangle.nc),
+		material_id(triangle.material_id),
+		shape_id(triangle.shape_id), primitive_id(triangle.primitive_id)
 	{
-	public:
-		void add_triangle(const triangle<VB> triangle);
-		const std::vector<triangle<VB>>& get_triangles() const;
-		bool aabb_test(const ray& ray) const;
+	}
 
-	protected:
-		std::vector<triangle<VB>> triangles;
+	struct aabb
+	{
+		void grow(const float3& point);
+		void grow(const aabb& other);
+		float3 centroid() const;
+		float surface_area() const;
+		float aabb_test(const ray& ray, float max_t) const;
+
+		float3 aabb_min = float3(std::numeric_limits<float>::max());
+		float3 aabb_max = float3(std::numeric_limits<float>::lowest());
+	};
+
+	// Node of the intermediate tree produced by the builder
+	struct bvh_build_node
+	{
+		bool is_leaf() const { return !left; }
+
+		aabb bounds;
+		std::unique_ptr<bvh_build_node> left;
+		std::unique_ptr<bvh_build_node> right;
+		// Range of primitives in the reordered primitive list, used by leaves only
+		size_t first = 0;
+		size_t count = 0;
+	};
+
+	// Node of the flattened hierarchy. Nodes are stored in depth-first order,
+	// so the left child always follows its parent and only the right one is referenced
+	struct bvh_node
+	{
+		bool is_leaf() const { return count > 0; }
+		float aabb_test(const ray& ray, float max_t) const;
 
 		float3 aabb_min;
+		// Index of the right child for inner nodes or of the first primitive for leaves
+		uint32_t offset;
 		float3 aabb_max;
+		// Number of primitives, 0 for inner nodes
+		uint32_t count;
+	};
+	static_assert(sizeof(bvh_node) == 32, "Two BVH nodes should share a cache line");
+
+	struct bvh_build_settings
+	{
+		// Number of centroid bins per axis, 0 makes an exact sweep over sorted primitives
+		size_t bins = 16;
+		size_t min_leaf_size = 1;
+		size_t max_leaf_size = 8;
+		float traversal_cost = 1.f;
+		float intersection_cost = 1.f;
+		// Nodes with fewer primitives are built without spawning a new task
+		size_t task_threshold = 4096;
+		// Branching factor used for traversal: 2, 4 (SSE) or 8 (AVX2)
+		size_t width = 4;
+	};
+
+	struct bvh_split
+	{
+		int axis = -1;
+		float cost = std::numeric_limits<float>::max();
+		// Index in the sorted range for a sweep split or the first right bin for a binned one
+		size_t position = 0;
+		float bin_origin = 0.f;
+		float bin_scale = 0.f;
+	};
+
+	// Top-down builder which splits nodes using the surface area heuristic.
+	// Works on primitive bounds only, so it is not tied to triangles.
+	// Subtrees are built in parallel with OpenMP tasks
+	class bvh_builder
+	{
+	public:
+		std::unique_ptr<bvh_build_node> build(const std::vector<aabb>& primitive_bounds);
+		// Order of primitives referenced by leaf ranges
+		const std::vector<size_t>& get_primitive_order() const;
+
+		bvh_build_settings settings;
+
+	protected:
+		std::unique_ptr<bvh_build_node> build_node(size_t first, size_t count, size_t depth);
+		bvh_split find_sweep_split(size_t first, size_t count) const;
+		bvh_split find_binned_split(size_t first, size_t count, const aabb& centroid_bounds) const;
+		size_t get_bin(size_t primitive, const bvh_split& split) const;
+
+		const std::vector<aabb>* bounds = nullptr;
+		std::vector<float3> centroids;
+		std::vector<size_t> order;
+	};
+
+	// Traversal stack is fixed, so the builder never goes deeper than this
+	static constexpr size_t BVH_MAX_DEPTH = 64;
+
+	// Node with up to N children whose bounds are stored plane by plane,
+	// so all children are tested against a ray at once
+	template<size_t N>
+	struct wide_bvh_node
+	{
+		alignas(4 * N) float min_x[N];
+		alignas(4 * N) float min_y[N];
+		alignas(4 * N) float min_z[N];
+		alignas(4 * N) float max_x[N];
+		alignas(4 * N) float max_y[N];
+		alignas(4 * N) float max_z[N];
+		// Index of a wide node for inner children or of the first primitive for leaves
+		uint32_t offset[N];
+		// Number of primitives in a leaf child, 0 for inner children
+		uint32_t count[N];
+	};
+
+	// Wide BVH collapsed from the binary one. Leaves keep their primitive ranges
+	template<size_t N>
+	class wide_bvh
+	{
+	public:
+		void build(const std::vector<bvh_node>& binary_nodes);
+
+		template<typename F>
+		void traverse(const ray& ray, const float& max_t, F&& visit_leaf) const;
+
+	protected:
+		uint32_t collapse(const std::vector<bvh_node>& binary_nodes, uint32_t binary_id);
+
+		std::vector<wide_bvh_node<N>> nodes;
+	};
+
+#ifdef RAYTRACER_AVX2
+	static constexpr size_t TRIANGLE_BLOCK_SIZE = 8;
+#else
+	static constexpr size_t TRIANGLE_BLOCK_SIZE = 4;
+#endif
+
+	// Intersection data of up to N triangles of one leaf stored plane by plane,
+	// so all of them are tested against a ray at once
+	template<size_t N>
+	struct triangle_block
+	{
+		alignas(4 * N) float a_x[N];
+		alignas(4 * N) float a_y[N];
+		alignas(4 * N) float a_z[N];
+		alignas(4 * N) float ba_x[N];
+		alignas(4 * N) float ba_y[N];
+		alignas(4 * N) float ba_z[N];
+		alignas(4 * N) float ca_x[N];
+		alignas(4 * N) float ca_y[N];
+		alignas(4 * N) float ca_z[N];
+		// Index in the shading array or PRIMITIVE_NONE for unused lanes
+		uint32_t primitive_id[N];
+	};
+
+	// Scalar fallback of the Moller-Trumbore test over a triangle block.
+	// Returns the lane of the closest hit between `min_t` and `max_t` or -1
+	template<size_t N>
+	inline int intersect_block(
+			const triangle_block<N>& block, const ray& ray, float min_t, float max_t, float& t, float& u, float& v)
+	{
+		int closest_lane = -1;
+		for (size_t i = 0; i < N; i++) {
+			float3 ba(block.ba_x[i], block.ba_y[i], block.ba_z[i]);
+			float3 ca(block.ca_x[i], block.ca_y[i], block.ca_z[i]);
+
+			float3 pvec = cross(ray.direction, ca);
+			float det = dot(ba, pvec);
+			if (det > -1e-8 && det < 1e-8) {
+				continue;
+			}
+			float inv_det = 1.f / det;
+
+			float3 tvec = ray.position - float3(block.a_x[i], block.a_y[i], block.a_z[i]);
+			float lane_u = dot(tvec, pvec) * inv_det;
+			if (lane_u < 0.f || lane_u > 1.f) {
+				continue;
+			}
+
+			float3 qvec = cross(tvec, ba);
+			float lane_v = dot(ray.direction, qvec) * inv_det;
+			if (lane_v < 0.f || lane_u + lane_v > 1.f) {
+				continue;
+			}
+
+			float lane_t = dot(ca, qvec) * inv_det;
+			if (lane_t > min_t && lane_t < max_t) {
+				max_t = t = lane_t;
+				u = lane_u;
+				v = lane_v;
+				closest_lane = static_cast<int>(i);
+			}
+		}
+		return closest_lane;
+	}
+
+	// Picks the closest lane among the hit ones after a vectorized test
+	template<size_t N>
+	inline int closest_lane(unsigned mask, const float* lane_t, const float* lane_u, const float* lane_v, float& t, float& u, float& v)
+	{
+		int closest = -1;
+		for (size_t i = 0; i < N; i++) {
+			if ((mask & (1u << i)) && (closest < 0 || lane_t[i] < lane_t[closest])) {
+				closest = static_cast<int>(i);
+			}
+		}
+		if (closest >= 0) {
+			t = lane_t[closest];
+			u = lane_u[closest];
+			v = lane_v[closest];
+		}
+		return closest;
+	}
+
+#ifdef RAYTRACER_SSE
+	inline int intersect_block(
+			const triangle_block<4>& block, const ray& ray, float min_t, float max_t, float& t, float& u, float& v)
+	{
+		__m128 dx = _mm_set1_ps(ray.direction.x);
+		__m128 dy = _mm_set1_ps(ray.direction.y);
+		__m128 dz = _mm_set1_ps(ray.direction.z);
+		__m128 ba_x = _mm_load_ps(block.ba_x);
+		__m128 ba_y = _mm_load_ps(block.ba_y);
+		__m128 ba_z = _mm_load_ps(block.ba_z);
+		__m128 ca_x = _mm_load_ps(block.ca_x);
+		__m128 ca_y = _mm_load_ps(block.ca_y);
+		__m128 ca_z = _mm_load_ps(block.ca_z);
+
+		// pvec = cross(direction, ca)
+		__m128 px = _mm_sub_ps(_mm_mul_ps(dy, ca_z), _mm_mul_ps(dz, ca_y));
+		__m128 py = _mm_sub_ps(_mm_mul_ps(dz, ca_x), _mm_mul_ps(dx, ca_z));
+		__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, ca_y), _mm_mul_ps(dy, ca_x));
+		__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ba_x, px), _mm_mul_ps(ba_y, py)), _mm_mul_ps(ba_z, pz));
+		__m128 inv_det = _mm_div_ps(_mm_set1_ps(1.f), det);
+
+		// tvec = position - a
+		__m128 tx = _mm_sub_ps(_mm_set1_ps(ray.position.x), _mm_load_ps(block.a_x));
+		__m128 ty = _mm_sub_ps(_mm_set1_ps(ray.position.y), _mm_load_ps(block.a_y));
+		__m128 tz = _mm_sub_ps(_mm_set1_ps(ray.position.z), _mm_load_ps(block.a_z));
+		__m128 lane_u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+
+		// qvec = cross(tvec, ba)
+		__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, ba_z), _mm_mul_ps(tz, ba_y));
+		__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, ba_x), _mm_mul_ps(tx, ba_z));
+		__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, ba_y), _mm_mul_ps(ty, ba_x));
+		__m128 lane_v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+		__m128 lane_t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ca_x, qx), _mm_mul_ps(ca_y, qy)), _mm_mul_ps(ca_z, qz)), inv_det);
+
+		__m128 zero = _mm_setzero_ps();
+		__m128 one = _mm_set1_ps(1.f);
+		__m128 hit = _mm_cmpgt_ps(_mm_andnot_ps(_mm_set1_ps(-0.f), det), _mm_set1_ps(1e-8f));
+		hit = _mm_and_ps(hit, _mm_cmpge_ps(lane_u, zero));
+		hit = _mm_and_ps(hit, _mm_cmple_ps(lane_u, one));
+		hit = _mm_and_ps(hit, _mm_cmpge_ps(lane_v, zero));
+		hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(lane_u, lane_v), one));
+		hit = _mm_and_ps(hit, _mm_cmpgt_ps(lane_t, _mm_set1_ps(min_t)));
+		hit = _mm_and_ps(hit, _mm_cmplt_ps(lane_t, _mm_set1_ps(max_t)));
+
+		unsigned mask = static_cast<unsigned>(_mm_movemask_ps(hit));
+		if (!mask) {
+			return -1;
+		}
+
+		alignas(16) float t_values[4], u_values[4], v_values[4];
+		_mm_store_ps(t_values, lane_t);
+		_mm_store_ps(u_values, lane_u);
+		_mm_store_ps(v_values, lane_v);
+		return closest_lane<4>(mask, t_values, u_values, v_values, t, u, v);
+	}
+#endif
+
+#ifdef RAYTRACER_AVX2
+	inline int intersect_block(
+			const triangle_block<8>& block, const ray& ray, float min_t, float max_t, float& t, float& u, float& v)
+	{
+		__m256 dx = _mm256_set1_ps(ray.direction.x);
+		__m256 dy = _mm256_set1_ps(ray.direction.y);
+		__m256 dz = _mm256_set1_ps(ray.direction.z);
+		__m256 ba_x = _mm256_load_ps(block.ba_x);
+		__m256 ba_y = _mm256_load_ps(block.ba_y);
+		__m256 ba_z = _mm256_load_ps(block.ba_z);
+		__m256 ca_x = _mm256_load_ps(block.ca_x);
+		__m256 ca_y = _mm256_load_ps(block.ca_y);
+		__m256 ca_z = _mm256_load_ps(block.ca_z);
+
+		// pvec = cross(direction, ca)
+		__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, ca_z), _mm256_mul_ps(dz, ca_y));
+		__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, ca_x), _mm256_mul_ps(dx, ca_z));
+		__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, ca_y), _mm256_mul_ps(dy, ca_x));
+		__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ba_x, px), _mm256_mul_ps(ba_y, py)), _mm256_mul_ps(ba_z, pz));
+		__m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.f), det);
+
+		// tvec = position - a
+		__m256 tx = _mm256_sub_ps(_mm256_set1_ps(ray.position.x), _mm256_load_ps(block.a_x));
+		__m256 ty = _mm256_sub_ps(_mm256_set1_ps(ray.position.y), _mm256_load_ps(block.a_y));
+		__m256 tz = _mm256_sub_ps(_mm256_set1_ps(ray.position.z), _mm256_load_ps(block.a_z));
+		__m256 lane_u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), inv_det);
+
+		// qvec = cross(tvec, ba)
+		__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, ba_z), _mm256_mul_ps(tz, ba_y));
+		__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, ba_x), _mm256_mul_ps(tx, ba_z));
+		__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, ba_y), _mm256_mul_ps(ty, ba_x));
+		__m256 lane_v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv_det);
+		__m256 lane_t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ca_x, qx), _mm256_mul_ps(ca_y, qy)), _mm256_mul_ps(ca_z, qz)), inv_det);
+
+		__m256 zero = _mm256_setzero_ps();
+		__m256 one = _mm256_set1_ps(1.f);
+		__m256 hit = _mm256_cmp_ps(_mm256_andnot_ps(_mm256_set1_ps(-0.f), det), _mm256_set1_ps(1e-8f), _CMP_GT_OQ);
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(lane_u, zero, _CMP_GE_OQ));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(lane_u, one, _CMP_LE_OQ));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(lane_v, zero, _CMP_GE_OQ));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(lane_u, lane_v), one, _CMP_LE_OQ));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(lane_t, _mm256_set1_ps(min_t), _CMP_GT_OQ));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(lane_t, _mm256_set1_ps(max_t), _CMP_LT_OQ));
+
+		unsigned mask = static_cast<unsigned>(_mm256_movemask_ps(hit));
+		if (!mask) {
+			return -1;
+		}
+
+		alignas(32) float t_values[8], u_values[8], v_values[8];
+		_mm256_store_ps(t_values, lane_t);
+		_mm256_store_ps(u_values, lane_u);
+		_mm256_store_ps(v_values, lane_v);
+		return closest_lane<8>(mask, t_values, u_values, v_values, t, u, v);
+	}
+#endif
+
+	template<typename VB>
+	class bvh
+	{
+	public:
+		void build(std::vector<triangle<VB>> in_triangles);
+		// Moves triangles to new positions and updates bounds bottom-up, keeping the tree.
+		// `in_triangles` come in the order given to `build` and have the same count
+		void refit(const std::vector<triangle<VB>>& in_triangles);
+		// Whole triangle put together from its intersection and shading data
+		triangle<VB> get_triangle(uint32_t primitive_id) const;
+		// Shading data indexed by primitive ID
+		const std::vector<triangle_shading>& get_shading() const;
+
+		// Visits leaves which the ray enters before `max_t` in front-to-back order.
+		// `max_t` is re-read on every step, so closer hits prune the rest of the tree.
+		// `visit_leaf(first, count)` returns true to stop the traversal
+		template<typename F>
+		void traverse(const ray& ray, const float& max_t, F&& visit_leaf) const;
+
+		// Traverses the binary hierarchy with a coherent packet, one box test covers all rays.
+		// `max_t` holds the closest hit of each ray and is re-read on every step.
+		// `visit_leaf(first, count, mask)` intersects the leaf with rays from the mask
+		template<size_t P, typename F>
+		void traverse_packet(const ray_packet<P>& packet, const float* max_t, F&& visit_leaf) const;
+
+		aabb get_bounds() const;
+
+		// Finds the closest triangle of a leaf between `min_t` and `payload.t`.
+		// Updates `t`, barycentrics and the primitive of the payload and returns the primitive ID or PRIMITIVE_NONE
+		uint32_t intersect_leaf(const ray& ray, uint32_t first, uint32_t count, float min_t, payload& payload) const;
+
+		// Expected cost of a random ray relative to the root box, lower is better
+		float get_sah_cost() const;
+		// Cost right after the last build, refits only make it worse
+		float get_build_sah_cost() const;
+
+		// Built hierarchy in the format of `acceleration_cache.h`. Wide nodes are collapsed again on load,
+		// so a hierarchy may be read with a different `builder.settings.width`
+		void save(std::ostream& stream) const;
+		// Returns false and leaves the hierarchy unusable if the stream is damaged
+		bool load(std::istream& stream);
+
+		bvh_builder builder;
+
+	protected:
+		void build_triangle_blocks(const std::vector<triangle<VB>>& in_triangles);
+		void set_block_lane(const triangle<VB>& triangle, uint32_t slot);
+		void build_wide_bvh();
+
+		// Leaves reference their first triangle block and the number of triangles
+		std::vector<bvh_node> nodes;
+		wide_bvh<4> bvh4;
+		wide_bvh<8> bvh8;
+		// Vertex and edges of every triangle, the only triangle data read during traversal
+		std::vector<triangle_block<TRIANGLE_BLOCK_SIZE>> blocks;
+		// Per stored triangle: normals and materials, block * TRIANGLE_BLOCK_SIZE + lane of its
+		// intersection data and the index given to `build`
+		std::vector<triangle_shading> shading;
+		std::vector<uint32_t> primitive_slots;
+		std::vector<uint32_t> primitive_order;
+		float build_sah_cost = 0.f;
+	};
+
+	// Placement of a mesh in the world
+	struct instance
+	{
+		uint32_t mesh_id = 0;
+		float4x4 transform = linalg::identity;
+	};
+
+	// Top level of the acceleration structure: a hierarchy over instances of per-mesh hierarchies.
+	// Rays are moved into the object space of every instance they reach, so a mesh placed
+	// many times is stored once
+	template<typename VB>
+	class top_level_bvh
+	{
+	public:
+		void build(std::vector<std::shared_ptr<bvh<VB>>> in_meshes, std::vector<instance> in_instances);
+
+		// Same as `bvh::traverse` with `visit_leaf(instance_id, object_ray, first, count)`.
+		// Distances along the object ray are those along the world one
+		template<typename F>
+		void traverse(const ray& ray, const float& max_t, F&& visit_leaf) const;
+
+		// Same as `bvh::traverse_packet` with `visit_leaf(instance_id, object_rays, first, count, mask)`.
+		// Packets which lose coherence in the object space of an instance go on ray by ray
+		template<size_t P, typename F>
+		void traverse_packet(const ray_packet<P>& packet, const ray* rays, const float* max_t, F&& visit_leaf) const;
+
+		// Intersects a leaf of the instance's mesh, a hit also stores the instance in the payload
+		uint32_t intersect_leaf(uint32_t instance_id, const ray& object_ray, uint32_t first, uint32_t count,
+								float min_t, payload& payload) const;
+
+		// Triangle of an instance moved to the world for shading
+		triangle<VB> get_triangle(uint32_t instance_id, uint32_t primitive_id) const;
+
+		const std::vector<std::shared_ptr<bvh<VB>>>& get_meshes() const;
+		const std::vector<instance>& get_instances() const;
+		aabb get_bounds() const;
+		// SAH cost of the top level where reaching an instance costs as much as its mesh
+		float get_sah_cost() const;
+
+		bvh_builder builder;
+
+	protected:
+		ray to_object_space(uint32_t instance_id, const ray& ray) const;
+
+		std::vector<std::shared_ptr<bvh<VB>>> meshes;
+		std::vector<instance> instances;
+		// Per instance: world to object transform, transform of normals and world bounds
+		std::vector<float4x4> inverse_transforms;
+		std::vector<float3x3> normal_transforms;
+		std::vector<aabb> instance_bounds;
+		// Identity instances trace world rays as they are
+		std::vector<uint8_t> identity;
+
+		// Leaves reference ranges of `instance_order`
+		std::vector<bvh_node> nodes;
+		std::vector<uint32_t> instance_order;
 	};
 
 	struct light
@@ -92,197 +695,1323 @@ namespace cg::renderer
 		float3 color;
 	};
 
-	template<typename VB, typename RT>
-	class raytracer
+	// Result of shading a hit without tracing further, used by the wavefront mode
+	struct bounce
+	{
+		// Light leaving the surface towards the incoming ray
+		float3 emitted;
+		// Light from sampled light sources reflected towards the incoming ray
+		float3 direct = float3(0.f);
+		// Lights were sampled here, so emission found by `next_ray` is already a part of `direct`
+		bool sampled_lights = false;
+		// Weight of light arriving along `next_ray`, already divided by `pdf`
+		float3 attenuation;
+		ray next_ray;
+		// Density of the `next_ray` direction per solid angle
+		float pdf = 0.f;
+		bool terminated = false;
+	};
+
+	// Path between bounces in the wavefront mode
+	struct path_state
+	{
+		ray path_ray;
+		float3 throughput;
+		uint32_t pixel;
+		sampler path_sampler;
+		bool count_emitted = true;
+	};
+
+	// What the primary ray of a sample hit, averaged per pixel into the AOV buffers.
+	// Misses leave everything at zero and have no IDs
+	struct primary_hit
+	{
+		float3 normal = float3(0.f);
+		float3 albedo = float3(0.f);
+		// Distance from the camera plane
+		float depth = 0.f;
+		uint2 id = uint2(PRIMITIVE_NONE);
+	};
+
+	// Per-pixel state of the wavefront mode. Allocated for the whole viewport once, frames only resize
+	// the path lists within their capacity
+	struct wavefront_buffers
+	{
+		std::vector<float3> radiance;
+		std::vector<uint8_t> active;
+		std::vector<primary_hit> primary_hits;
+		std::vector<path_state> paths;
+		std::vector<path_state> sorted_paths;
+		std::vector<uint32_t> keys;
+		std::vector<uint32_t> sorted_keys;
+		std::vector<payload> hits;
+	};
+
+	// Auxiliary outputs of the raytracer for denoising, compositing and debugging
+	struct aov_buffers
+	{
+		// Means over all samples of world normals, diffuse albedo and linear depth of primary hits
+		std::shared_ptr<cg::resource<float3>> normal;
+		std::shared_ptr<cg::resource<float3>> albedo;
+		std::shared_ptr<cg::resource<float>> depth;
+		// Shape and primitive hit by the first sample of the pixel, PRIMITIVE_NONE on a miss
+		std::shared_ptr<cg::resource<uint2>> id;
+		std::shared_ptr<cg::resource<unsigned int>> sample_count;
+	};
+
+	// Key which groups rays starting close to each other and going into the same octant
+	inline uint32_t get_ray_sort_key(const ray& ray, const aabb& scene_bounds)
+	{
+		float3 extent = max(scene_bounds.aabb_max - scene_bounds.aabb_min, float3(1e-6f));
+		float3 cell = clamp((ray.position - scene_bounds.aabb_min) / extent, 0.f, 1.f) * 511.f;
+
+		// Interleaves 9 bits of every axis into a 27-bit Morton code
+		auto spread = [](uint32_t value) {
+			uint32_t result = 0;
+			for (uint32_t bit = 0; bit < 9; bit++) {
+				result |= ((value >> bit) & 1u) << (3 * bit);
+			}
+			return result;
+		};
+		uint32_t morton = spread(static_cast<uint32_t>(cell.x)) |
+			(spread(static_cast<uint32_t>(cell.y)) << 1) |
+			(spread(static_cast<uint32_t>(cell.z)) << 2);
+
+		uint32_t octant = (ray.direction.x < 0.f ? 1u : 0u) |
+			(ray.direction.y < 0.f ? 2u : 0u) |
+			(ray.direction.z < 0.f ? 4u : 0u);
+		return (octant << 27) | morton;
+	}
+
+	// LSD radix sort of paths by 32-bit keys, 8 bits per pass. Passes ping-pong between the inputs and
+	// the scratch vectors, which keep their capacity between calls
+	inline void sort_paths(std::vector<path_state>& paths, std::vector<uint32_t>& keys,
+						   std::vector<path_state>& sorted_paths, std::vector<uint32_t>& sorted_keys)
+	{
+		sorted_paths.resize(paths.size());
+		sorted_keys.resize(keys.size());
+
+		for (uint32_t shift = 0; shift < 32; shift += 8) {
+			size_t offsets[257] = {};
+			for (uint32_t key : keys) {
+				offsets[((key >> shift) & 0xff) + 1]++;
+			}
+			for (size_t i = 1; i < 257; i++) {
+				offsets[i] += offsets[i - 1];
+			}
+			for (size_t i = 0; i < keys.size(); i++) {
+				size_t position = offsets[(keys[i] >> shift) & 0xff]++;
+				sorted_keys[position] = keys[i];
+				sorted_paths[position] = paths[i];
+			}
+			keys.swap(sorted_keys);
+			paths.swap(sorted_paths);
+		}
+	}
+
+	// Shader stages called through std::function, so they can be swapped at run time
+	template<typename VB>
+	struct dynamic_shaders
+	{
+		std::function<payload(const ray& ray)> miss_shader = nullptr;
+		std::function<payload(const ray& ray, payload& payload, const triangle<VB>& triangle, size_t depth)>
+				closest_hit_shader = nullptr;
+		std::function<payload(const ray& ray, payload& payload, const triangle<VB>& triangle)> any_hit_shader =
+				nullptr;
+		// Shades a hit and returns the next ray instead of tracing it. When set, paths are traced by
+		// `trace_path` or the wavefront mode, and `closest_hit_shader` is left out
+		std::function<bounce(const ray& ray, const payload& payload, const triangle<VB>& triangle, sampler& sampler)>
+				bounce_shader = nullptr;
+	};
+
+	// Stage left out of `static_shaders`, its checks fold to false and its calls are never made
+	struct no_shader
+	{
+		struct result
+		{
+			template<typename T>
+			operator T() const { return T{}; }
+		};
+
+		template<typename... Args>
+		result operator()(Args&&...) const { return {}; }
+	};
+
+	// Shader stages given as types: the trace loops call them directly and can inline them.
+	// The raytracer uses them the same way as `dynamic_shaders`
+	template<typename Miss, typename ClosestHit = no_shader, typename AnyHit = no_shader, typename Bounce = no_shader>
+	struct static_shaders
+	{
+		Miss miss_shader;
+		ClosestHit closest_hit_shader;
+		AnyHit any_hit_shader;
+		Bounce bounce_shader;
+	};
+
+	constexpr bool has_shader(const no_shader&)
+	{
+		return false;
+	}
+
+	template<typename Signature>
+	inline bool has_shader(const std::function<Signature>& shader)
+	{
+		return static_cast<bool>(shader);
+	}
+
+	template<typename Shader>
+	constexpr bool has_shader(const Shader&)
+	{
+		return true;
+	}
+
+	template<typename VB, typename RT, typename Shaders = dynamic_shaders<VB>>
+	class raytracer : public Shaders
 	{
 	public:
 		raytracer(){};
+		explicit raytracer(Shaders shaders) : Shaders(std::move(shaders)){};
 		~raytracer(){};
 
 		void set_render_target(std::shared_ptr<resource<RT>> in_render_target);
 		void clear_render_target(const RT& in_clear_value);
 		void set_viewport(size_t in_width, size_t in_height);
+		// Traces only the given window of the viewport, pixels outside of it stay black
+		void set_crop(size_t x, size_t y, size_t crop_width, size_t crop_height);
 
 		void set_vertex_buffers(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers);
 		void set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers);
+		// Table indexed by `material_id` of vertices, it must cover every vertex
+		void set_materials(std::vector<cg::material> in_materials);
+		const cg::material& get_material(uint32_t material_id) const;
+		// Places shapes by `mesh_id`, e.g. to repeat one shape many times. Without instances every
+		// shape is placed once as it is, all of them in a single bottom-level hierarchy
+		std::vector<instance> instances;
 		void build_acceleration_structure();
-		std::vector<aabb<VB>> acceleration_structures;
-
+		// Picks up moved vertices and changed instance transforms without rebuilding, e.g. between frames
+		// of an animation. Index buffers and the list of instances must stay the same. A mesh is rebuilt
+		// only when refitting made its SAH cost grow past `refit_rebuild_ratio` times its last build cost
+		void refit_acceleration_structure();
+		std::shared_ptr<top_level_bvh<VB>> acceleration_structure;
+		bvh_build_settings bvh_settings;
+		float refit_rebuild_ratio = 1.5f;
+		// Directory where built mesh hierarchies are kept between runs, named by a hash of the geometry
+		// and `bvh_settings`. Empty disables the cache
+		std::filesystem::path acceleration_cache_path;
+
+		// Traces frames until `accumulation_num` frames are accumulated, including frames of a loaded checkpoint
 		void ray_generation(float3 position, float3 direction, float3 right, float3 up, size_t depth, size_t accumulation_num);
 
+		// Accumulated pixels and the frame count, so a later process can continue sampling the same image.
+		// Sampler streams depend only on the seed and per-pixel sample counts, so they need no extra state
+		void save_checkpoint(const std::filesystem::path& path) const;
+		void load_checkpoint(const std::filesystem::path& path);
+		// Filled on primary hits while paths are traced with `bounce_shader`
+		aov_buffers get_aov_buffers() const;
+		// Filters the resolved image with guides captured on primary hits. Guides are only captured when
+		// paths are traced with `bounce_shader`
+		bool denoise = false;
+		cg::renderer::denoiser denoiser;
+
+		// Frames between checkpoints written to `checkpoint_path`, 0 disables them
+		size_t checkpoint_interval = 0;
+		std::filesystem::path checkpoint_path;
+
 		payload trace_ray(const ray& ray, size_t depth, float max_t = 1000.f, float min_t = 0.001f) const;
+		// Checks whether anything lies between `min_t` and `max_t` along the ray, e.g. in front of a light.
+		// Stops at the first hit and runs no shaders
+		bool trace_occlusion(const ray& ray, float max_t, float min_t = 0.001f) const;
+		// Finds the closest hit without running any shader and returns its triangle in world space
+		std::optional<triangle<VB>> find_closest_hit(const ray& ray, payload& payload, float max_t = 1000.f, float min_t = 0.001f) const;
+		// Same as `find_closest_hit`, but only fills `t`, barycentrics and IDs of the payload.
+		// Returns false on a miss
+		bool intersect_closest(const ray& ray, payload& payload, float max_t = 1000.f, float min_t = 0.001f) const;
+		// Traces P rays together. Falls back to `trace_ray` for incoherent rays and any-hit queries.
+		// `samplers`, if any, become the current sampler while the matching ray is shaded
+		template<size_t P>
+		void trace_packet(const ray* rays, payload* payloads, size_t depth, sampler* samplers = nullptr,
+						  float max_t = 1000.f, float min_t = 0.001f) const;
+		// Follows a path bounce by bounce with `bounce_shader`, so the stack stays flat at any depth.
+		// Returns the radiance carried back along the ray
+		float3 trace_path(const ray& ray, size_t depth, sampler& sampler) const;
 		payload intersection_shader(const triangle<VB>& triangle, const ray& ray) const;
 
-		std::function<payload(const ray& ray)> miss_shader = nullptr;
-		std::function<payload(const ray& ray, payload& payload, const triangle<VB>& triangle, size_t depth)>
-				closest_hit_shader = nullptr;
-		std::function<payload(const ray& ray, payload& payload, const triangle<VB>& triangle)> any_hit_shader =
-				nullptr;
+		// Point lights, sampled together with emissive triangles by `sample_direct_light`
+		std::vector<light> lights;
+		// Light arriving at a point straight from every point light and from one emissive triangle picked
+		// by power, as radiance times cosine over pdf. Shadow rays drop occluded samples
+		float3 sample_direct_light(const float3& position, const float3& normal, sampler& sampler) const;
 
 		float2 get_jitter(int frame_id);
+		// Sampler of the pixel sample which the calling thread traces in the recursive mode
+		static sampler& get_sampler();
+
+		sampler_type sampler_kind = sampler_type::sobol;
+		uint32_t seed = 0;
+
+		// Side of square pixel blocks traced as packets: 2, 4 or 0 to trace every ray alone
+		size_t packet_size = 0;
+		// Traces every bounce of all paths as one sorted batch instead of recursing per ray
+		bool wavefront = false;
+		// Side of square screen tiles handed out to threads, rounded up to whole packets
+		size_t tile_size = 16;
+		// Bounces every path gets before Russian roulette may end it, 0 disables the roulette
+		size_t russian_roulette_depth = 3;
+		// A pixel stops sampling once the standard error of its luminance falls below
+		// this fraction of the mean. 0 traces every pixel in every frame
+		float adaptive_threshold = 0.f;
+		size_t min_samples = 4;
 
 	protected:
+		ray primary_ray(int x, int y, float2 jitter) const;
+		// Streams are keyed by the pixel and its sample index, not by the thread which traces them
+		sampler pixel_sampler(int x, int y) const;
+		void accumulate(int x, int y, const float3& color, const primary_hit& hit = {});
+		primary_hit get_primary_hit(const ray& ray, const payload& hit, const std::optional<triangle<VB>>& hit_triangle) const;
+		bool is_converged(int x, int y) const;
+		void resolve();
+		void trace_frame(float2 jitter, size_t depth);
+		void trace_block(int block_x, int block_y, int block, float2 jitter, size_t depth);
+		void trace_frame_wavefront(float2 jitter, size_t depth);
+		void allocate_wavefront_buffers();
+		// Triangles of `shape_count` shapes starting at `first_shape`
+		std::vector<triangle<VB>> get_shape_triangles(size_t first_shape, size_t shape_count) const;
+		uint64_t get_acceleration_cache_key() const;
+		// Fill `meshes` and return true on a cache hit
+		bool load_acceleration_cache(const std::filesystem::path& path, uint64_t key, std::vector<std::shared_ptr<bvh<VB>>>& meshes) const;
+		void save_acceleration_cache(const std::filesystem::path& path, uint64_t key, const std::vector<std::shared_ptr<bvh<VB>>>& meshes) const;
+		void build_light_distribution();
+		// Closest hits of a coherent packet, returns false without tracing for an incoherent one
+		template<size_t P>
+		bool find_closest_hits(const ray* rays, payload* payloads, std::optional<triangle<VB>>* closest_triangles,
+							   float max_t = 1000.f, float min_t = 0.001f) const;
+		// Path loop from an already found first hit
+		float3 shade_path(ray path_ray, payload hit, std::optional<triangle<VB>> hit_triangle, size_t depth, sampler& sampler) const;
+		// Ends a path with probability falling with its throughput, and boosts the survivors to stay unbiased
+		bool russian_roulette(size_t bounce_id, float3& throughput, sampler& sampler) const;
+
+		float3 camera_position;
+		float3 camera_direction;
+		float3 camera_right;
+		float3 camera_up;
+
 		std::shared_ptr<cg::resource<RT>> render_target;
+		// Running mean of linear color per pixel
 		std::shared_ptr<cg::resource<float3>> history;
+		// Sum of squared deviations of luminance from the running mean (Welford)
+		std::shared_ptr<cg::resource<float>> history_m2;
+		std::shared_ptr<cg::resource<unsigned int>> sample_count;
+		// Running means of primary hits, same weights as `history`
+		std::shared_ptr<cg::resource<float3>> normal_buffer;
+		std::shared_ptr<cg::resource<float3>> albedo_buffer;
+		std::shared_ptr<cg::resource<float>> depth_buffer;
+		std::shared_ptr<cg::resource<uint2>> id_buffer;
+		size_t frame_count = 0;
 		std::vector<std::shared_ptr<cg::resource<unsigned int>>> index_buffers;
 		std::vector<std::shared_ptr<cg::resource<VB>>> vertex_buffers;
-		std::vector<triangle<VB>> triangles;
+		std::vector<cg::material> materials;
+
+		// Instance and primitive IDs of emissive triangles and running sums of their power
+		std::vector<uint2> emissive_triangles;
+		std::vector<float> emissive_cdf;
 
 		size_t width = 1920;
 		size_t height = 1080;
+
+		size_t crop_x = 0;
+		size_t crop_y = 0;
+		size_t crop_width = 1920;
+		size_t crop_height = 1080;
+
+		wavefront_buffers wavefront_state;
+
+		static inline thread_local sampler current_sampler;
 	};
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::set_render_target(
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::set_render_target(
 			std::shared_ptr<resource<RT>> in_render_target)
 	{
 		render_target = std::move(in_render_target);
 
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::set_viewport(size_t in_width,
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::set_viewport(size_t in_width,
 												size_t in_height)
 	{
 		width = in_width;
 		height = in_height;
 		history = std::make_shared<cg::resource<float3>>(width, height);
+		history_m2 = std::make_shared<cg::resource<float>>(width, height);
+		sample_count = std::make_shared<cg::resource<unsigned int>>(width, height);
+		normal_buffer = std::make_shared<cg::resource<float3>>(width, height);
+		albedo_buffer = std::make_shared<cg::resource<float3>>(width, height);
+		depth_buffer = std::make_shared<cg::resource<float>>(width, height);
+		id_buffer = std::make_shared<cg::resource<uint2>>(width, height);
+		wavefront_state = {};
+		set_crop(0, 0, width, height);
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::set_crop(size_t x, size_t y, size_t in_crop_width, size_t in_crop_height)
+	{
+		if (in_crop_width == 0 || in_crop_height == 0 || x + in_crop_width > width || y + in_crop_height > height) {
+			THROW_ERROR("Crop window must lie inside of the viewport");
+		}
+		crop_x = x;
+		crop_y = y;
+		crop_width = in_crop_width;
+		crop_height = in_crop_height;
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::clear_render_target(
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::clear_render_target(
 			const RT& in_clear_value)
 	{
 		for (size_t i = 0; i < render_target->count(); i++) {
 			render_target->item(i) = in_clear_value;
 			history->item(i) = float3(0.f);
+			history_m2->item(i) = 0.f;
+			sample_count->item(i) = 0;
+			normal_buffer->item(i) = float3(0.f);
+			albedo_buffer->item(i) = float3(0.f);
+			depth_buffer->item(i) = 0.f;
+			id_buffer->item(i) = uint2(PRIMITIVE_NONE);
+		}
+		frame_count = 0;
+		if (wavefront) {
+			allocate_wavefront_buffers();
 		}
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::set_vertex_buffers(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers)
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::set_vertex_buffers(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers)
 	{
 		vertex_buffers = std::move(in_vertex_buffers);
 	}
 
-	template<typename VB, typename RT>
-	void raytracer<VB, RT>::set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers)
+	template<typename VB, typename RT, typename Shaders>
+	void raytracer<VB, RT, Shaders>::set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers)
 	{
 		index_buffers = std::move(in_index_buffers);
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::build_acceleration_structure()
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::set_materials(std::vector<cg::material> in_materials)
 	{
-		// Building triangles
-		for (size_t s = 0; s < index_buffers.size(); s++) {
-			auto &index_buffer = index_buffers[s];
-			auto &vertex_buffer = vertex_buffers[s];
-			size_t i = 0;
-			aabb<VB> aabb;
-			while (i < index_buffer->count()) {
-				triangle<VB> triangle(
-					vertex_buffer->item(index_buffer->item(i++)),
-					vertex_buffer->item(index_buffer->item(i++)),
-					vertex_buffer->item(index_buffer->item(i++))
-				);
-				aabb.add_triangle(triangle);
-			}
-			acceleration_structures.push_back(aabb);
-		}
+		materials = std::move(in_materials);
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::ray_generation(
-			float3 position, float3 direction,
-			float3 right, float3 up, size_t depth, size_t accumulation_num)
+	template<typename VB, typename RT, typename Shaders>
+	inline const cg::material& raytracer<VB, RT, Shaders>::get_material(uint32_t material_id) const
 	{
-		float frame_weight = 1.f/accumulation_num;
-		// Calculates several subframes and overlay them each on other, so diagonal edges are smooth on the final picture
-		for (int frame_id = 0; frame_id < accumulation_num; frame_id++) {
-			std::cout << "Tracing frame #" << frame_id + 1 << "/" << accumulation_num << "\n";
-			float2 jitter = get_jitter(frame_id);
-			// Counting in parallel because each ray is independent
-			// Automatically generates code with threads
-			#pragma omp parallel for
-			for (int x = 0; x < width; x++) {
-				for (int y = 0; y < height; y++) {
-					
-					float u = (2.f * x + jitter.x) / static_cast<float>(width - 1) - 1.f;
-					u *= static_cast<float>(width)/static_cast<float>(height);
-
-					float v = (2.f * y + jitter.y) / static_cast<float>(height - 1) - 1.f;
-
-					float3 ray_direction = direction + u * right - v * up;
-
-					ray ray(position, ray_direction);
+		return materials[material_id];
+	}
 
-					payload payload = trace_ray(ray, depth);
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::build_acceleration_structure()
+	{
+		std::vector<std::shared_ptr<bvh<VB>>> meshes;
+		std::vector<instance> scene_instances = instances;
+		if (instances.empty()) {
+			scene_instances.push_back(instance{});
+		}
 
-					auto& history_pixel = history->item(x, y);
-					history_pixel += sqrt(payload.color.to_float3() * frame_weight);
+		std::filesystem::path cache_file;
+		uint64_t key = 0;
+		if (!acceleration_cache_path.empty()) {
+			key = get_acceleration_cache_key();
+			cache_file = acceleration_cache_path / (to_hex(key) + ".bvh");
+		}
+		if (cache_file.empty() || !load_acceleration_cache(cache_file, key, meshes)) {
+			meshes.resize(instances.empty() ? 1 : index_buffers.size());
+			for (size_t m = 0; m < meshes.size(); m++) {
+				meshes[m] = std::make_shared<bvh<VB>>();
+				meshes[m]->builder.settings = bvh_settings;
+				meshes[m]->build(instances.empty() ? get_shape_triangles(0, index_buffers.size()) : get_shape_triangles(m, 1));
+			}
+			if (!cache_file.empty()) {
+				save_acceleration_cache(cache_file, key, meshes);
+			}
+		}
 
-					if (frame_id + 1 == accumulation_num) {
-						render_target->item(x, y) = RT::from_float3(history_pixel);
-					}
+		acceleration_structure = std::make_shared<top_level_bvh<VB>>();
+		acceleration_structure->builder.settings = bvh_settings;
+		// Overlapping instances can't be skipped anyway, so every one gets its own leaf
+		acceleration_structure->builder.settings.max_leaf_size = 1;
+		acceleration_structure->build(std::move(meshes), std::move(scene_instances));
+		build_light_distribution();
+	}
 
-				}
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::refit_acceleration_structure()
+	{
+		auto meshes = acceleration_structure->get_meshes();
+		for (size_t m = 0; m < meshes.size(); m++) {
+			auto triangles = instances.empty() ? get_shape_triangles(0, index_buffers.size()) : get_shape_triangles(m, 1);
+			meshes[m]->refit(triangles);
+			if (meshes[m]->get_sah_cost() > refit_rebuild_ratio * meshes[m]->get_build_sah_cost()) {
+				meshes[m]->build(std::move(triangles));
 			}
 		}
 
+		// The top level holds one leaf per instance and is cheap enough to build anew
+		std::vector<instance> scene_instances = instances;
+		if (instances.empty()) {
+			scene_instances.push_back(instance{});
+		}
+		acceleration_structure->build(std::move(meshes), std::move(scene_instances));
+		build_light_distribution();
 	}
 
-	template<typename VB, typename RT>
-	inline payload raytracer<VB, RT>::trace_ray(
-			const ray& ray, size_t depth, float max_t, float min_t) const
+	template<typename VB, typename RT, typename Shaders>
+	inline uint64_t raytracer<VB, RT, Shaders>::get_acceleration_cache_key() const
 	{
-		if (depth == 0) {
-			return miss_shader(ray);
+		// Layout of cached data depends on the vertex type and the SIMD width of this build
+		uint64_t key = hash_value(sizeof(triangle_shading));
+		key = hash_value(TRIANGLE_BLOCK_SIZE, key);
+		key = hash_value(bvh_settings.bins, key);
+		key = hash_value(bvh_settings.min_leaf_size, key);
+		key = hash_value(bvh_settings.max_leaf_size, key);
+		key = hash_value(bvh_settings.traversal_cost, key);
+		key = hash_value(bvh_settings.intersection_cost, key);
+		// Without instances all shapes share one mesh, transforms only matter to the top level
+		key = hash_value(instances.empty(), key);
+		key = hash_value(index_buffers.size(), key);
+		for (size_t s = 0; s < index_buffers.size(); s++) {
+			key = hash_value(index_buffers[s]->count(), key);
+			key = hash_bytes(index_buffers[s]->get_data(), index_buffers[s]->size_bytes(), key);
+			key = hash_value(vertex_buffers[s]->count(), key);
+			key = hash_bytes(vertex_buffers[s]->get_data(), vertex_buffers[s]->size_bytes(), key);
 		}
-		depth--;
-		
-		payload closest_hit_payload{};
-		// Not counting triangles that are too far away
-		closest_hit_payload.t = max_t;
+		return key;
+	}
 
-		const triangle<VB>* closest_triangle = nullptr;
-		
-		for (auto& aabb : acceleration_structures) {
-			if (!aabb.aabb_test(ray)) {
-				continue;
-			}
+	template<typename VB, typename RT, typename Shaders>
+	inline bool raytracer<VB, RT, Shaders>::load_acceleration_cache(
+			const std::filesystem::path& path, uint64_t key, std::vector<std::shared_ptr<bvh<VB>>>& meshes) const
+	{
+		// Read in bulk rather than mapped, so the hierarchies own their memory and may be refit
+		std::ifstream file(path, std::ios::binary);
+		if (!file) {
+			return false;
+		}
 
-			for (auto & triangle : aabb.get_triangles()) {
-				payload payload = intersection_shader(triangle, ray);
-				if (payload.t > min_t && payload.t < closest_hit_payload.t) {
-					if (any_hit_shader) {
-						return any_hit_shader(ray, payload, triangle);
-					}
-					closest_hit_payload = payload;
-					closest_triangle = &triangle;
-				}
-			}
+		acceleration_cache_header header{};
+		acceleration_cache_header expected{};
+		if (!read_header(file, header) || !std::equal(header.magic, header.magic + 4, expected.magic) ||
+			header.version != expected.version || header.key != key) {
+			return false;
+		}
+		if (header.mesh_count != (instances.empty() ? 1 : index_buffers.size())) {
+			std::cout << "Ignoring damaged acceleration structure cache " << path << "\n";
+			return false;
 		}
 
-		if (closest_hit_payload.t < max_t) {
-			if (closest_hit_shader) {
-				return closest_hit_shader(ray, closest_hit_payload, *closest_triangle, depth);
+		std::vector<std::shared_ptr<bvh<VB>>> loaded(header.mesh_count);
+		for (auto& mesh : loaded) {
+			mesh = std::make_shared<bvh<VB>>();
+			mesh->builder.settings = bvh_settings;
+			if (!mesh->load(file)) {
+				std::cout << "Ignoring damaged acceleration structure cache " << path << "\n";
+				return false;
 			}
 		}
-
-		return miss_shader(ray);
+		meshes = std::move(loaded);
+		std::cout << "Loaded acceleration structure from " << path << "\n";
+		return true;
 	}
 
-	// Define if intersection inside of an triangle
-	template<typename VB, typename RT>
-	inline payload raytracer<VB, RT>::intersection_shader(
-			const triangle<VB>& triangle, const ray& ray) const
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::save_acceleration_cache(
+			const std::filesystem::path& path, uint64_t key, const std::vector<std::shared_ptr<bvh<VB>>>& meshes) const
 	{
-		payload payload{};
-		payload.t = -1.f;
+		std::filesystem::create_directories(path.parent_path());
+		// Renamed into place as checkpoints are, so a concurrent run never reads a torn file
+		auto temporary_path = path;
+		temporary_path += ".tmp";
+		{
+			std::ofstream file(temporary_path, std::ios::binary);
+			if (!file) {
+				THROW_ERROR("Can't write acceleration structure cache " + temporary_path.string());
+			}
+			acceleration_cache_header header{};
+			header.key = key;
+			header.mesh_count = static_cast<uint32_t>(meshes.size());
+			write_header(file, header);
+			for (const auto& mesh : meshes) {
+				mesh->save(file);
+			}
+			if (!file) {
+				THROW_ERROR("Can't write acceleration structure cache " + temporary_path.string());
+			}
+		}
+		std::filesystem::rename(temporary_path, path);
+	}
 
-		float3 pvec = cross(ray.direction, triangle.ca);
-		float det = dot(triangle.ba, pvec);
+	template<typename VB, typename RT, typename Shaders>
+	inline std::vector<triangle<VB>> raytracer<VB, RT, Shaders>::get_shape_triangles(size_t first_shape, size_t shape_count) const
+	{
+		std::vector<triangle<VB>> triangles;
+		for (size_t s = first_shape; s < first_shape + shape_count; s++) {
+			auto &index_buffer = index_buffers[s];
+			auto &vertex_buffer = vertex_buffers[s];
+			for (size_t i = 0; i + 2 < index_buffer->count(); i += 3) {
+				auto& triangle = triangles.emplace_back(
+					vertex_buffer->item(index_buffer->item(i)),
+					vertex_buffer->item(index_buffer->item(i + 1)),
+					vertex_buffer->item(index_buffer->item(i + 2))
+				);
+				triangle.shape_id = static_cast<uint32_t>(s);
+				triangle.primitive_id = static_cast<uint32_t>(i / 3);
+			}
+		}
+
+		return triangles;
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::build_light_distribution()
+	{
+		emissive_triangles.clear();
+		emissive_cdf.clear();
+
+		// Emission is looked up once per mesh, areas change with every placement
+		const auto& meshes = acceleration_structure->get_meshes();
+		std::vector<std::vector<uint32_t>> emissive_primitives(meshes.size());
+		for (size_t m = 0; m < meshes.size(); m++) {
+			const auto& shading = meshes[m]->get_shading();
+			for (uint32_t i = 0; i < shading.size(); i++) {
+				// Shading looks materials up unchecked, so a bad index is caught once here
+				if (shading[i].material_id >= materials.size()) {
+					THROW_ERROR("Triangle refers to a missing material " + std::to_string(shading[i].material_id));
+				}
+				if (luminance(get_material(shading[i].material_id).emissive) > 0.f) {
+					emissive_primitives[m].push_back(i);
+				}
+			}
+		}
+
+		const auto& scene_instances = acceleration_structure->get_instances();
+		float total_power = 0.f;
+		for (uint32_t instance_id = 0; instance_id < scene_instances.size(); instance_id++) {
+			for (uint32_t primitive_id : emissive_primitives[scene_instances[instance_id].mesh_id]) {
+				auto triangle = acceleration_structure->get_triangle(instance_id, primitive_id);
+				float area = 0.5f * length(cross(triangle.ba, triangle.ca));
+				if (area > 0.f) {
+					total_power += luminance(get_material(triangle.material_id).emissive) * area;
+					emissive_triangles.push_back(uint2(instance_id, primitive_id));
+					emissive_cdf.push_back(total_power);
+				}
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline float3 raytracer<VB, RT, Shaders>::sample_direct_light(
+			const float3& position, const float3& normal, sampler& sampler) const
+	{
+		float3 result(0.f);
+
+		for (const auto& light : lights) {
+			float3 to_light = light.position - position;
+			float distance = length(to_light);
+			float3 direction = to_light / distance;
+			float cos_surface = dot(normal, direction);
+			if (cos_surface > 0.f && !trace_occlusion(ray(position, direction), distance)) {
+				result += light.color * cos_surface / (distance * distance);
+			}
+		}
+
+		if (emissive_triangles.empty()) {
+			return result;
+		}
+
+		// Samples are drawn before any early exit, so every path uses the same sampler dimensions
+		float pick = sampler.get_1d() * emissive_cdf.back();
+		float2 bary = sample_triangle(sampler.get_2d());
+
+		size_t index = std::upper_bound(emissive_cdf.begin(), emissive_cdf.end(), pick) - emissive_cdf.begin();
+		index = std::min(index, emissive_cdf.size() - 1);
+		float probability = (emissive_cdf[index] - (index > 0 ? emissive_cdf[index - 1] : 0.f)) / emissive_cdf.back();
+
+		auto light_triangle = acceleration_structure->get_triangle(emissive_triangles[index].x, emissive_triangles[index].y);
+		float3 light_position = light_triangle.a + bary.x * light_triangle.ba + bary.y * light_triangle.ca;
+		float3 light_normal = cross(light_triangle.ba, light_triangle.ca);
+		float area = 0.5f * length(light_normal);
+		light_normal /= 2.f * area;
+
+		float3 to_light = light_position - position;
+		float distance = length(to_light);
+		float3 direction = to_light / distance;
+		float cos_surface = dot(normal, direction);
+		// Emissive triangles shine from both sides, as they do when a ray hits them
+		float cos_light = std::abs(dot(light_normal, direction));
+		if (cos_surface <= 0.f || cos_light <= 0.f) {
+			return result;
+		}
+
+		// Stops short of the light, so the light itself does not occlude the sample
+		if (trace_occlusion(ray(position, direction), distance * (1.f - 1e-4f))) {
+			return result;
+		}
+
+		float pdf = probability / area * distance * distance / cos_light;
+		result += get_material(light_triangle.material_id).emissive * cos_surface / pdf;
+		return result;
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::ray_generation(
+			float3 position, float3 direction,
+			float3 right, float3 up, size_t depth, size_t accumulation_num)
+	{
+		camera_position = position;
+		camera_direction = direction;
+		camera_right = right;
+		camera_up = up;
+
+		// Calculates several subframes and overlay them each on other, so diagonal edges are smooth on the final picture
+		for (size_t frame_id = frame_count; frame_id < accumulation_num; frame_id++) {
+			int active_pixels = 0;
+			#pragma omp parallel for reduction(+:active_pixels)
+			for (int y = static_cast<int>(crop_y); y < crop_y + crop_height; y++) {
+				for (int x = static_cast<int>(crop_x); x < crop_x + crop_width; x++) {
+					active_pixels += is_converged(x, y) ? 0 : 1;
+				}
+			}
+			if (active_pixels == 0) {
+				std::cout << "All pixels converged after " << frame_id << " frames\n";
+				break;
+			}
+
+			std::cout << "Tracing frame #" << frame_id + 1 << "/" << accumulation_num
+					  << " (" << active_pixels << " pixels)\n";
+			float2 jitter = get_jitter(static_cast<int>(frame_id));
+
+			if (wavefront && has_shader(this->bounce_shader)) {
+				trace_frame_wavefront(jitter, depth);
+			}
+			else {
+				trace_frame(jitter, depth);
+			}
+
+			frame_count = frame_id + 1;
+			if (checkpoint_interval > 0 && frame_count % checkpoint_interval == 0) {
+				save_checkpoint(checkpoint_path);
+			}
+		}
+
+		if (checkpoint_interval > 0) {
+			save_checkpoint(checkpoint_path);
+		}
+		resolve();
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::save_checkpoint(const std::filesystem::path& path) const
+	{
+		checkpoint checkpoint;
+		auto& header = checkpoint.header;
+		header.width = static_cast<uint32_t>(width);
+		header.height = static_cast<uint32_t>(height);
+		header.region_x = static_cast<uint32_t>(crop_x);
+		header.region_y = static_cast<uint32_t>(crop_y);
+		header.region_width = static_cast<uint32_t>(crop_width);
+		header.region_height = static_cast<uint32_t>(crop_height);
+		header.frame_count = static_cast<uint32_t>(frame_count);
+		header.seed = seed;
+		header.sampler_kind = static_cast<uint32_t>(sampler_kind);
+
+		for (size_t y = crop_y; y < crop_y + crop_height; y++) {
+			for (size_t x = crop_x; x < crop_x + crop_width; x++) {
+				checkpoint.mean.push_back(history->item(x, y));
+				checkpoint.m2.push_back(history_m2->item(x, y));
+				checkpoint.sample_count.push_back(sample_count->item(x, y));
+				checkpoint.normal.push_back(normal_buffer->item(x, y));
+				checkpoint.albedo.push_back(albedo_buffer->item(x, y));
+				checkpoint.depth.push_back(depth_buffer->item(x, y));
+				checkpoint.id.push_back(id_buffer->item(x, y));
+			}
+		}
+		cg::renderer::save_checkpoint(checkpoint, path);
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::load_checkpoint(const std::filesystem::path& path)
+	{
+		checkpoint checkpoint = cg::renderer::load_checkpoint(path);
+		const auto& header = checkpoint.header;
+		if (header.width != width || header.height != height) {
+			THROW_ERROR("Checkpoint resolution doesn't match the render target");
+		}
+		if (header.region_x != crop_x || header.region_y != crop_y ||
+			header.region_width != crop_width || header.region_height != crop_height) {
+			THROW_ERROR("Checkpoint region doesn't match the crop window");
+		}
+		// Other samplers would repeat or correlate with the samples already taken
+		if (header.seed != seed || header.sampler_kind != static_cast<uint32_t>(sampler_kind)) {
+			THROW_ERROR("Checkpoint was rendered with another seed or sampler");
+		}
+
+		size_t i = 0;
+		for (size_t y = crop_y; y < crop_y + crop_height; y++) {
+			for (size_t x = crop_x; x < crop_x + crop_width; x++, i++) {
+				history->item(x, y) = checkpoint.mean[i];
+				history_m2->item(x, y) = checkpoint.m2[i];
+				sample_count->item(x, y) = checkpoint.sample_count[i];
+				normal_buffer->item(x, y) = checkpoint.normal[i];
+				albedo_buffer->item(x, y) = checkpoint.albedo[i];
+				depth_buffer->item(x, y) = checkpoint.depth[i];
+				id_buffer->item(x, y) = checkpoint.id[i];
+			}
+		}
+		frame_count = header.frame_count;
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline aov_buffers raytracer<VB, RT, Shaders>::get_aov_buffers() const
+	{
+		return {normal_buffer, albedo_buffer, depth_buffer, id_buffer, sample_count};
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline ray raytracer<VB, RT, Shaders>::primary_ray(int x, int y, float2 jitter) const
+	{
+		float u = (2.f * x + jitter.x) / static_cast<float>(width - 1) - 1.f;
+		u *= static_cast<float>(width)/static_cast<float>(height);
+
+		float v = (2.f * y + jitter.y) / static_cast<float>(height - 1) - 1.f;
+
+		float3 ray_direction = camera_direction + u * camera_right - v * camera_up;
+
+		return ray(camera_position, ray_direction);
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline sampler raytracer<VB, RT, Shaders>::pixel_sampler(int x, int y) const
+	{
+		return sampler(sampler_kind, seed, static_cast<uint32_t>(y * width + x), sample_count->item(x, y));
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline sampler& raytracer<VB, RT, Shaders>::get_sampler()
+	{
+		return current_sampler;
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::accumulate(int x, int y, const float3& color, const primary_hit& hit)
+	{
+		auto& history_pixel = history->item(x, y);
+		unsigned int count = ++sample_count->item(x, y);
+
+		float old_mean = luminance(history_pixel);
+		history_pixel += (color - history_pixel) / static_cast<float>(count);
+		history_m2->item(x, y) += (luminance(color) - old_mean) * (luminance(color) - luminance(history_pixel));
+
+		float weight = 1.f / static_cast<float>(count);
+		normal_buffer->item(x, y) += (hit.normal - normal_buffer->item(x, y)) * weight;
+		albedo_buffer->item(x, y) += (hit.albedo - albedo_buffer->item(x, y)) * weight;
+		depth_buffer->item(x, y) += (hit.depth - depth_buffer->item(x, y)) * weight;
+		// IDs can't be averaged, the first sample keeps them stable from frame to frame
+		if (count == 1) {
+			id_buffer->item(x, y) = hit.id;
+		}
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline primary_hit raytracer<VB, RT, Shaders>::get_primary_hit(
+			const ray& ray, const payload& hit, const std::optional<triangle<VB>>& hit_triangle) const
+	{
+		primary_hit result;
+		if (!hit_triangle) {
+			return result;
+		}
+		float3 normal = normalize(
+			hit.bary.x * hit_triangle->na + hit.bary.y * hit_triangle->nb + hit.bary.z * hit_triangle->nc);
+		// Faces the camera, like the two-sided shading does
+		result.normal = dot(normal, ray.direction) > 0.f ? -normal : normal;
+		result.albedo = get_material(hit_triangle->material_id).diffuse;
+		result.depth = hit.t * dot(ray.direction, normalize(camera_direction));
+		result.id = uint2(hit_triangle->shape_id, hit_triangle->primitive_id);
+		return result;
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline bool raytracer<VB, RT, Shaders>::is_converged(int x, int y) const
+	{
+		unsigned int count = sample_count->item(x, y);
+		if (adaptive_threshold <= 0.f || count < std::max<size_t>(min_samples, 2)) {
+			return false;
+		}
+
+		float variance = history_m2->item(x, y) / (count - 1);
+		float standard_error = std::sqrt(variance / count);
+		float mean = luminance(history->item(x, y));
+		// Keeps dark pixels from chasing a relative error of an almost zero mean
+		return standard_error <= adaptive_threshold * std::max(mean, 1e-3f);
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::resolve()
+	{
+		if (!denoise) {
+			#pragma omp parallel for
+			for (int i = 0; i < render_target->count(); i++) {
+				render_target->item(i) = RT::from_float3(sqrt(history->item(i)));
+			}
+			return;
+		}
+
+		// Filters a copy, so checkpoints keep the raw accumulation
+		cg::resource<float3> color(width, height);
+		cg::resource<float> variance(width, height);
+		#pragma omp parallel for
+		for (int i = 0; i < color.count(); i++) {
+			color.item(i) = history->item(i);
+			unsigned int count = sample_count->item(i);
+			float mean = luminance(color.item(i));
+			// A single sample has no spread to measure, so it is taken as fully noisy
+			variance.item(i) = count > 1 ? history_m2->item(i) / (count - 1) / count : mean * mean;
+		}
+
+		denoiser.denoise(color, variance, *normal_buffer, *albedo_buffer, *depth_buffer);
+
+		#pragma omp parallel for
+		for (int i = 0; i < render_target->count(); i++) {
+			render_target->item(i) = RT::from_float3(sqrt(color.item(i)));
+		}
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::trace_frame(float2 jitter, size_t depth)
+	{
+		// Neighbouring primary rays are traced as one packet, blocks cut by the image or crop border go ray by ray
+		int block = (packet_size == 2 || packet_size == 4) ? static_cast<int>(packet_size) : 1;
+
+		int tile = std::max(static_cast<int>(tile_size), block);
+		tile = (tile + block - 1) / block * block;
+		int tiles_x = (static_cast<int>(crop_width) + tile - 1) / tile;
+		int tiles_y = (static_cast<int>(crop_height) + tile - 1) / tile;
+
+		int blocks_per_tile = tile / block;
+		uint32_t curve_side = 1;
+		while (curve_side < blocks_per_tile) {
+			curve_side *= 2;
+		}
+
+		// Empty background tiles finish fast, so their threads steal work from the busy ones
+		cg::utils::tile_scheduler scheduler(tiles_x * tiles_y, omp_get_max_threads());
+
+		#pragma omp parallel
+		{
+			size_t tile_id;
+			while (scheduler.next_tile(omp_get_thread_num(), tile_id)) {
+				int tile_x = static_cast<int>(crop_x + tile_id % tiles_x * tile);
+				int tile_y = static_cast<int>(crop_y + tile_id / tiles_x * tile);
+
+				// Blocks of a tile follow a Z-order curve, so consecutive rays stay close on screen and in the scene
+				for (uint32_t code = 0; code < curve_side * curve_side; code++) {
+					auto [block_x, block_y] = cg::utils::morton_decode(code);
+					if (block_x < blocks_per_tile && block_y < blocks_per_tile) {
+						trace_block(tile_x + block_x * block, tile_y + block_y * block, block, jitter, depth);
+					}
+				}
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::trace_block(
+			int block_x, int block_y, int block, float2 jitter, size_t depth)
+	{
+		ray rays[16];
+		payload payloads[16];
+		sampler samplers[16];
+		int2 pixels[16];
+		size_t ray_count = 0;
+
+		for (int dy = 0; dy < block; dy++) {
+			for (int dx = 0; dx < block; dx++) {
+				int x = block_x + dx;
+				int y = block_y + dy;
+				if (x < crop_x + crop_width && y < crop_y + crop_height && !is_converged(x, y)) {
+					pixels[ray_count] = int2(x, y);
+					samplers[ray_count] = pixel_sampler(x, y);
+					rays[ray_count++] = primary_ray(x, y, jitter);
+				}
+			}
+		}
+
+		if (has_shader(this->bounce_shader)) {
+			// Primary rays of a full block still share one packet traversal, the rest of every path is a loop
+			payload hits[16]{};
+			std::optional<triangle<VB>> hit_triangles[16];
+			bool packet_traced = depth > 0 &&
+				((block == 2 && ray_count == 4 && find_closest_hits<4>(rays, hits, hit_triangles)) ||
+				 (block == 4 && ray_count == 16 && find_closest_hits<16>(rays, hits, hit_triangles)));
+
+			for (size_t i = 0; i < ray_count; i++) {
+				if (!packet_traced && depth > 0) {
+					hit_triangles[i] = find_closest_hit(rays[i], hits[i]);
+				}
+				float3 color = shade_path(rays[i], hits[i], hit_triangles[i], depth, samplers[i]);
+				accumulate(pixels[i].x, pixels[i].y, color, get_primary_hit(rays[i], hits[i], hit_triangles[i]));
+			}
+			return;
+		}
+
+		if (block == 2 && ray_count == 4) {
+			trace_packet<4>(rays, payloads, depth, samplers);
+		}
+		else if (block == 4 && ray_count == 16) {
+			trace_packet<16>(rays, payloads, depth, samplers);
+		}
+		else {
+			for (size_t i = 0; i < ray_count; i++) {
+				current_sampler = samplers[i];
+				payloads[i] = trace_ray(rays[i], depth);
+			}
+		}
+
+		for (size_t i = 0; i < ray_count; i++) {
+			accumulate(pixels[i].x, pixels[i].y, payloads[i].color.to_float3());
+		}
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::allocate_wavefront_buffers()
+	{
+		size_t pixel_count = width * height;
+		wavefront_state.radiance.resize(pixel_count);
+		wavefront_state.active.resize(pixel_count);
+		wavefront_state.primary_hits.resize(pixel_count);
+		wavefront_state.paths.reserve(pixel_count);
+		wavefront_state.sorted_paths.reserve(pixel_count);
+		wavefront_state.keys.reserve(pixel_count);
+		wavefront_state.sorted_keys.reserve(pixel_count);
+		wavefront_state.hits.reserve(pixel_count);
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline void raytracer<VB, RT, Shaders>::trace_frame_wavefront(float2 jitter, size_t depth)
+	{
+		// Normally done by `clear_render_target`, unless the mode was switched on after it
+		if (wavefront_state.radiance.size() != width * height) {
+			allocate_wavefront_buffers();
+		}
+		auto& radiance = wavefront_state.radiance;
+		auto& active = wavefront_state.active;
+		auto& primary_hits = wavefront_state.primary_hits;
+		auto& paths = wavefront_state.paths;
+		auto& keys = wavefront_state.keys;
+		auto& hits = wavefront_state.hits;
+		paths.resize(width * height);
+
+		#pragma omp parallel for
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				size_t pixel = y * width + x;
+				bool in_crop = x >= crop_x && x < crop_x + crop_width && y >= crop_y && y < crop_y + crop_height;
+				active[pixel] = in_crop && !is_converged(x, y);
+				radiance[pixel] = float3(0.f);
+				primary_hits[pixel] = {};
+				paths[pixel] = {
+					primary_ray(x, y, jitter), float3(active[pixel] ? 1.f : 0.f),
+					static_cast<uint32_t>(pixel), pixel_sampler(x, y)
+				};
+			}
+		}
+
+		// Converged pixels start with zero throughput and are dropped here
+		auto remove_finished = [&]() {
+			paths.erase(std::remove_if(paths.begin(), paths.end(), [](const path_state& path) {
+				return path.throughput == float3(0.f);
+			}), paths.end());
+		};
+		remove_finished();
+		keys.resize(paths.size());
+		hits.resize(paths.size());
+
+		aabb scene_bounds = acceleration_structure->get_bounds();
+
+		// Every iteration is one bounce of all live paths: sort, trace, shade and compact.
+		// As in the recursive mode, paths which run out of depth end with the miss shader
+		for (size_t bounce_id = 0; bounce_id <= depth && !paths.empty(); bounce_id++) {
+			size_t path_count = paths.size();
+			bool last_bounce = bounce_id == depth;
+
+			if (!last_bounce) {
+				#pragma omp parallel for
+				for (int i = 0; i < path_count; i++) {
+					keys[i] = get_ray_sort_key(paths[i].path_ray, scene_bounds);
+				}
+				keys.resize(path_count);
+				sort_paths(paths, keys, wavefront_state.sorted_paths, wavefront_state.sorted_keys);
+
+				#pragma omp parallel for
+				for (int i = 0; i < path_count; i++) {
+					intersect_closest(paths[i].path_ray, hits[i]);
+				}
+			}
+
+			#pragma omp parallel for
+			for (int i = 0; i < path_count; i++) {
+				auto& path = paths[i];
+				// Hits keep only IDs, so the pass over all paths doesn't hold a triangle per path
+				std::optional<triangle<VB>> hit_triangle;
+				if (!last_bounce && hits[i].primitive_id != PRIMITIVE_NONE) {
+					hit_triangle = acceleration_structure->get_triangle(hits[i].instance_id, hits[i].primitive_id);
+				}
+				if (bounce_id == 0 && !last_bounce) {
+					primary_hits[path.pixel] = get_primary_hit(path.path_ray, hits[i], hit_triangle);
+				}
+				if (!hit_triangle) {
+					radiance[path.pixel] += path.throughput * this->miss_shader(path.path_ray).color.to_float3();
+					path.throughput = float3(0.f);
+					continue;
+				}
+
+				bounce result = this->bounce_shader(path.path_ray, hits[i], *hit_triangle, path.path_sampler);
+				radiance[path.pixel] += path.throughput * ((path.count_emitted ? result.emitted : float3(0.f)) + result.direct);
+				path.count_emitted = !result.sampled_lights;
+				if (result.terminated) {
+					path.throughput = float3(0.f);
+					continue;
+				}
+				path.throughput *= result.attenuation;
+				path.path_ray = result.next_ray;
+				if (!russian_roulette(bounce_id, path.throughput, path.path_sampler)) {
+					path.throughput = float3(0.f);
+				}
+			}
+
+			remove_finished();
+		}
+
+		#pragma omp parallel for
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				if (active[y * width + x]) {
+					accumulate(x, y, radiance[y * width + x], primary_hits[y * width + x]);
+				}
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline payload raytracer<VB, RT, Shaders>::trace_ray(
+			const ray& ray, size_t depth, float max_t, float min_t) const
+	{
+		if (depth == 0) {
+			return this->miss_shader(ray);
+		}
+		depth--;
+		
+		payload closest_hit_payload{};
+
+		if (!has_shader(this->any_hit_shader)) {
+			auto closest_triangle = find_closest_hit(ray, closest_hit_payload, max_t, min_t);
+			if (closest_triangle && has_shader(this->closest_hit_shader)) {
+				return this->closest_hit_shader(ray, closest_hit_payload, *closest_triangle, depth);
+			}
+			return this->miss_shader(ray);
+		}
+
+		// Any hit finishes the query, so the closest hit is never shaded
+		closest_hit_payload.t = max_t;
+		payload any_hit_payload{};
+		bool any_hit = false;
+
+		acceleration_structure->traverse(ray, closest_hit_payload.t, [&](uint32_t instance_id, const auto& object_ray, uint32_t first, uint32_t count) {
+			payload payload = closest_hit_payload;
+			uint32_t primitive_id = acceleration_structure->intersect_leaf(instance_id, object_ray, first, count, min_t, payload);
+			if (primitive_id == PRIMITIVE_NONE) {
+				return false;
+			}
+			any_hit_payload = this->any_hit_shader(ray, payload, acceleration_structure->get_triangle(instance_id, primitive_id));
+			any_hit = true;
+			return true;
+		});
+
+		if (any_hit) {
+			return any_hit_payload;
+		}
+
+		return this->miss_shader(ray);
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline bool raytracer<VB, RT, Shaders>::trace_occlusion(const ray& ray, float max_t, float min_t) const
+	{
+		bool occluded = false;
+		acceleration_structure->traverse(ray, max_t, [&](uint32_t instance_id, const auto& object_ray, uint32_t first, uint32_t count) {
+			payload payload{};
+			payload.t = max_t;
+			occluded = acceleration_structure->intersect_leaf(instance_id, object_ray, first, count, min_t, payload) != PRIMITIVE_NONE;
+			return occluded;
+		});
+		return occluded;
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline bool raytracer<VB, RT, Shaders>::intersect_closest(
+			const ray& ray, payload& payload, float max_t, float min_t) const
+	{
+		// Not counting triangles that are too far away
+		payload.t = max_t;
+		payload.primitive_id = PRIMITIVE_NONE;
+
+		acceleration_structure->traverse(ray, payload.t, [&](uint32_t instance_id, const auto& object_ray, uint32_t first, uint32_t count) {
+			acceleration_structure->intersect_leaf(instance_id, object_ray, first, count, min_t, payload);
+			return false;
+		});
+		return payload.primitive_id != PRIMITIVE_NONE;
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline std::optional<triangle<VB>> raytracer<VB, RT, Shaders>::find_closest_hit(
+			const ray& ray, payload& payload, float max_t, float min_t) const
+	{
+		if (!intersect_closest(ray, payload, max_t, min_t)) {
+			return std::nullopt;
+		}
+		return acceleration_structure->get_triangle(payload.instance_id, payload.primitive_id);
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	template<size_t P>
+	inline void raytracer<VB, RT, Shaders>::trace_packet(
+			const ray* rays, payload* payloads, size_t depth, sampler* samplers, float max_t, float min_t) const
+	{
+		payload closest_hit_payloads[P];
+		std::optional<triangle<VB>> closest_triangles[P];
+		if (depth == 0 || has_shader(this->any_hit_shader) || !find_closest_hits<P>(rays, closest_hit_payloads, closest_triangles, max_t, min_t)) {
+			for (size_t i = 0; i < P; i++) {
+				if (samplers) {
+					current_sampler = samplers[i];
+				}
+				payloads[i] = trace_ray(rays[i], depth, max_t, min_t);
+			}
+			return;
+		}
+		depth--;
+
+		for (size_t i = 0; i < P; i++) {
+			if (samplers) {
+				current_sampler = samplers[i];
+			}
+			if (closest_triangles[i] && has_shader(this->closest_hit_shader)) {
+				payloads[i] = this->closest_hit_shader(rays[i], closest_hit_payloads[i], *closest_triangles[i], depth);
+			}
+			else {
+				payloads[i] = this->miss_shader(rays[i]);
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	template<size_t P>
+	inline bool raytracer<VB, RT, Shaders>::find_closest_hits(
+			const ray* rays, payload* payloads, std::optional<triangle<VB>>* closest_triangles, float max_t, float min_t) const
+	{
+		ray_packet<P> packet(rays);
+		if (!packet.coherent) {
+			return false;
+		}
+
+		float closest_t[P];
+		for (size_t i = 0; i < P; i++) {
+			payloads[i] = payload{};
+			closest_t[i] = payloads[i].t = max_t;
+		}
+
+		acceleration_structure->traverse_packet(packet, rays, closest_t, [&](uint32_t instance_id, const ray* object_rays, uint32_t first, uint32_t count, unsigned mask) {
+			for (size_t i = 0; i < P; i++) {
+				if (!(mask & (1u << i))) {
+					continue;
+				}
+				uint32_t primitive_id = acceleration_structure->intersect_leaf(instance_id, object_rays[i], first, count, min_t, payloads[i]);
+				if (primitive_id != PRIMITIVE_NONE) {
+					closest_t[i] = payloads[i].t;
+				}
+			}
+		});
+
+		for (size_t i = 0; i < P; i++) {
+			closest_triangles[i] = payloads[i].primitive_id == PRIMITIVE_NONE ? std::nullopt :
+				std::optional(acceleration_structure->get_triangle(payloads[i].instance_id, payloads[i].primitive_id));
+		}
+		return true;
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline float3 raytracer<VB, RT, Shaders>::trace_path(const ray& ray, size_t depth, sampler& sampler) const
+	{
+		payload hit{};
+		auto hit_triangle = depth > 0 ? find_closest_hit(ray, hit) : std::nullopt;
+		return shade_path(ray, hit, hit_triangle, depth, sampler);
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline float3 raytracer<VB, RT, Shaders>::shade_path(
+			ray path_ray, payload hit, std::optional<triangle<VB>> hit_triangle, size_t depth, sampler& sampler) const
+	{
+		float3 radiance(0.f);
+		float3 throughput(1.f);
+		bool count_emitted = true;
+
+		// Same steps as a wavefront bounce, so both modes give equal images for equal samplers
+		for (size_t bounce_id = 0;; bounce_id++) {
+			if (!hit_triangle) {
+				radiance += throughput * this->miss_shader(path_ray).color.to_float3();
+				break;
+			}
+
+			bounce result = this->bounce_shader(path_ray, hit, *hit_triangle, sampler);
+			radiance += throughput * ((count_emitted ? result.emitted : float3(0.f)) + result.direct);
+			if (result.terminated) {
+				break;
+			}
+			throughput *= result.attenuation;
+			count_emitted = !result.sampled_lights;
+			path_ray = result.next_ray;
+			if (!russian_roulette(bounce_id, throughput, sampler)) {
+				break;
+			}
+
+			hit_triangle = bounce_id + 1 < depth ? find_closest_hit(path_ray, hit) : std::nullopt;
+		}
+
+		return radiance;
+	}
+
+	template<typename VB, typename RT, typename Shaders>
+	inline bool raytracer<VB, RT, Shaders>::russian_roulette(size_t bounce_id, float3& throughput, sampler& sampler) const
+	{
+		if (russian_roulette_depth == 0 || bounce_id + 1 < russian_roulette_depth) {
+			return true;
+		}
+		float survival = std::min(std::max({throughput.x, throughput.y, throughput.z}), 1.f);
+		if (sampler.get_1d() >= survival) {
+			return false;
+		}
+		throughput /= survival;
+		return true;
+	}
+
+	// Define if intersection inside of an triangle
+	template<typename VB, typename RT, typename Shaders>
+	inline payload raytracer<VB, RT, Shaders>::intersection_shader(
+			const triangle<VB>& triangle, const ray& ray) const
+	{
+		payload payload{};
+		payload.t = -1.f;
+
+		float3 pvec = cross(ray.direction, triangle.ca);
+		float det = dot(triangle.ba, pvec);
 
 		if (det > -1e-8 && det < 1e-8) {
 			return payload;
@@ -311,8 +2040,8 @@ namespace cg::renderer
 		return payload;
 	}
 
-	template<typename VB, typename RT>
-	float2 raytracer<VB, RT>::get_jitter(int frame_id)
+	template<typename VB, typename RT, typename Shaders>
+	float2 raytracer<VB, RT, Shaders>::get_jitter(int frame_id)
 	{
 		float2 result(0.f);
 
@@ -340,39 +2069,1064 @@ namespace cg::renderer
 	}
 
 
-	template<typename VB>
-	inline void aabb<VB>::add_triangle(const triangle<VB> triangle)
+	inline void aabb::grow(const float3& point)
 	{
-		if (triangles.empty()) {
-			aabb_max = aabb_min = triangle.a;
-		}
+		aabb_min = min(aabb_min, point);
+		aabb_max = max(aabb_max, point);
+	}
 
-		triangles.push_back(triangle);
+	inline void aabb::grow(const aabb& other)
+	{
+		aabb_min = min(aabb_min, other.aabb_min);
+		aabb_max = max(aabb_max, other.aabb_max);
+	}
 
-		aabb_max = max(aabb_max, triangle.a);
-		aabb_max = max(aabb_max, triangle.b);
-		aabb_max = max(aabb_max, triangle.c);
+	inline float3 aabb::centroid() const
+	{
+		return (aabb_min + aabb_max) * 0.5f;
+	}
 
-		aabb_min = min(aabb_min, triangle.a);
-		aabb_min = min(aabb_min, triangle.b);
-		aabb_min = min(aabb_min, triangle.c);
+	inline float aabb::surface_area() const
+	{
+		float3 extent = aabb_max - aabb_min;
+		if (extent.x < 0.f || extent.y < 0.f || extent.z < 0.f) {
+			return 0.f;
+		}
+		return 2.f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
 	}
 
-	template<typename VB>
-	inline const std::vector<triangle<VB>>& aabb<VB>::get_triangles() const
+	inline float aabb::aabb_test(const ray& ray, float max_t) const
 	{
-		return triangles;
+		return slab_test(ray, aabb_min, aabb_max, max_t);
 	}
 
-	template<typename VB>
-	inline bool aabb<VB>::aabb_test(const ray& ray) const
+	inline float bvh_node::aabb_test(const ray& ray, float max_t) const
 	{
-		float3 inv_ray_direction = float3(1.f) / ray.direction;
-		float3 t0 = (aabb_max - ray.position) * inv_ray_direction;
-		float3 t1 = (aabb_min - ray.position) * inv_ray_direction;
-		float3 tmax = max(t0, t1);
-		float3 tmin = min(t0, t1);
-		return maxelem(tmin) <= minelem(tmax);
+		return slab_test(ray, aabb_min, aabb_max, max_t);
+	}
+
+	inline std::unique_ptr<bvh_build_node> bvh_builder::build(const std::vector<aabb>& primitive_bounds)
+	{
+		bounds = &primitive_bounds;
+
+		centroids.resize(primitive_bounds.size());
+		for (size_t i = 0; i < primitive_bounds.size(); i++) {
+			centroids[i] = primitive_bounds[i].centroid();
+		}
+
+		order.resize(primitive_bounds.size());
+		std::iota(order.begin(), order.end(), 0);
+
+		if (primitive_bounds.empty()) {
+			return nullptr;
+		}
+
+		std::unique_ptr<bvh_build_node> root;
+#if RAYTRACER_OMP_TASKS
+		#pragma omp parallel
+		#pragma omp single
+#endif
+		root = build_node(0, primitive_bounds.size(), 0);
+		return root;
+	}
+
+	inline const std::vector<size_t>& bvh_builder::get_primitive_order() const
+	{
+		return order;
+	}
+
+	inline std::unique_ptr<bvh_build_node> bvh_builder::build_node(size_t first, size_t count, size_t depth)
+	{
+		auto node = std::make_unique<bvh_build_node>();
+		aabb centroid_bounds;
+		for (size_t i = first; i < first + count; i++) {
+			node->bounds.grow((*bounds)[order[i]]);
+			centroid_bounds.grow(centroids[order[i]]);
+		}
+		node->first = first;
+		node->count = count;
+
+		if (count <= settings.min_leaf_size || depth + 1 >= BVH_MAX_DEPTH) {
+			return node;
+		}
+
+		bvh_split split = settings.bins > 0 ?
+			find_binned_split(first, count, centroid_bounds) :
+			find_sweep_split(first, count);
+
+		float leaf_cost = settings.intersection_cost * count;
+		float split_cost = settings.traversal_cost;
+		float parent_area = node->bounds.surface_area();
+		if (parent_area > 0.f) {
+			split_cost += settings.intersection_cost * split.cost / parent_area;
+		}
+		if (split_cost >= leaf_cost && count <= settings.max_leaf_size) {
+			return node;
+		}
+
+		auto begin = order.begin() + first;
+		auto end = begin + count;
+		size_t left_count = 0;
+
+		if (split.axis >= 0 && settings.bins > 0) {
+			auto middle = std::partition(begin, end, [&](size_t id) { return get_bin(id, split) < split.position; });
+			left_count = middle - begin;
+		}
+		else if (split.axis >= 0) {
+			// Sweep leaves the range sorted by the last axis only
+			std::sort(begin, end, [&](size_t a, size_t b) { return centroids[a][split.axis] < centroids[b][split.axis]; });
+			left_count = split.position;
+		}
+
+		// All centroids are in one point, so any split is as good as the other
+		if (left_count == 0 || left_count == count) {
+			left_count = count / 2;
+		}
+
+		bvh_build_node* parent = node.get();
+		size_t right_first = first + left_count;
+		size_t right_count = count - left_count;
+
+#if RAYTRACER_OMP_TASKS
+		#pragma omp task if(left_count >= settings.task_threshold)
+		parent->left = build_node(first, left_count, depth + 1);
+		parent->right = build_node(right_first, right_count, depth + 1);
+		#pragma omp taskwait
+#else
+		parent->left = build_node(first, left_count, depth + 1);
+		parent->right = build_node(right_first, right_count, depth + 1);
+#endif
+
+		node->count = 0;
+		return node;
+	}
+
+	inline bvh_split bvh_builder::find_sweep_split(size_t first, size_t count) const
+	{
+		// Sorts a copy of the range along each axis and evaluates a split between every pair of neighbours.
+		// `right_area[i]` keeps the area of the box around primitives [i, count)
+		bvh_split best;
+		std::vector<size_t> sorted(order.begin() + first, order.begin() + first + count);
+		std::vector<float> right_area(count);
+
+		for (int axis = 0; axis < 3; axis++) {
+			std::sort(sorted.begin(), sorted.end(), [&](size_t a, size_t b) { return centroids[a][axis] < centroids[b][axis]; });
+
+			aabb right;
+			for (size_t i = count - 1; i > 0; i--) {
+				right.grow((*bounds)[sorted[i]]);
+				right_area[i] = right.surface_area();
+			}
+
+			aabb left;
+			for (size_t i = 1; i < count; i++) {
+				left.grow((*bounds)[sorted[i - 1]]);
+				float cost = left.surface_area() * i + right_area[i] * (count - i);
+				if (cost < best.cost) {
+					best.cost = cost;
+					best.axis = axis;
+					best.position = i;
+				}
+			}
+		}
+		return best;
+	}
+
+	inline bvh_split bvh_builder::find_binned_split(size_t first, size_t count, const aabb& centroid_bounds) const
+	{
+		// Drops centroids into equal bins along each axis and evaluates a split between every pair of bins
+		bvh_split best;
+		size_t bin_count = settings.bins;
+		std::vector<aabb> bin_bounds(bin_count);
+		std::vector<size_t> bin_sizes(bin_count);
+		std::vector<float> right_area(bin_count);
+
+		for (int axis = 0; axis < 3; axis++) {
+			float extent = centroid_bounds.aabb_max[axis] - centroid_bounds.aabb_min[axis];
+			if (extent <= 0.f) {
+				continue;
+			}
+
+			bvh_split candidate;
+			candidate.axis = axis;
+			candidate.bin_origin = centroid_bounds.aabb_min[axis];
+			candidate.bin_scale = bin_count / extent;
+
+			std::fill(bin_bounds.begin(), bin_bounds.end(), aabb{});
+			std::fill(bin_sizes.begin(), bin_sizes.end(), 0);
+			for (size_t i = first; i < first + count; i++) {
+				size_t bin = get_bin(order[i], candidate);
+				bin_bounds[bin].grow((*bounds)[order[i]]);
+				bin_sizes[bin]++;
+			}
+
+			aabb right;
+			for (size_t b = bin_count - 1; b > 0; b--) {
+				right.grow(bin_bounds[b]);
+				right_area[b] = right.surface_area();
+			}
+
+			aabb left;
+			size_t left_count = 0;
+			for (size_t b = 1; b < bin_count; b++) {
+				left.grow(bin_bounds[b - 1]);
+				left_count += bin_sizes[b - 1];
+				if (left_count == 0 || left_count == count) {
+					continue;
+				}
+				float cost = left.surface_area() * left_count + right_area[b] * (count - left_count);
+				if (cost < best.cost) {
+					best = candidate;
+					best.cost = cost;
+					best.position = b;
+				}
+			}
+		}
+		return best;
+	}
+
+	inline size_t bvh_builder::get_bin(size_t primitive, const bvh_split& split) const
+	{
+		float offset = (centroids[primitive][split.axis] - split.bin_origin) * split.bin_scale;
+		return std::min(static_cast<size_t>(std::max(offset, 0.f)), settings.bins - 1);
+	}
+
+	// Appends the build tree to `nodes` in depth-first order
+	inline void flatten_bvh(const bvh_build_node* build_node, std::vector<bvh_node>& nodes)
+	{
+		size_t id = nodes.size();
+		nodes.push_back(bvh_node{
+			build_node->bounds.aabb_min, static_cast<uint32_t>(build_node->first),
+			build_node->bounds.aabb_max, static_cast<uint32_t>(build_node->count)
+		});
+
+		if (!build_node->is_leaf()) {
+			flatten_bvh(build_node->left.get(), nodes);
+			nodes[id].offset = static_cast<uint32_t>(nodes.size());
+			flatten_bvh(build_node->right.get(), nodes);
+		}
+	}
+
+	// Front-to-back traversal of a binary hierarchy, shared by both levels of the acceleration structure.
+	// `visit_leaf(offset, count)` returns true to stop the traversal
+	template<typename F>
+	inline void traverse_bvh(const std::vector<bvh_node>& nodes, const ray& ray, const float& max_t, F&& visit_leaf)
+	{
+		if (nodes.empty()) {
+			return;
+		}
+
+		std::pair<uint32_t, float> stack[BVH_MAX_DEPTH + 1];
+		size_t stack_size = 0;
+
+		float root_t = nodes[0].aabb_test(ray, max_t);
+		if (root_t <= max_t) {
+			stack[stack_size++] = {0, root_t};
+		}
+
+		while (stack_size > 0) {
+			auto [node_id, entry_t] = stack[--stack_size];
+			// A closer hit was found after the node had been pushed
+			if (entry_t > max_t) {
+				continue;
+			}
+
+			const bvh_node& node = nodes[node_id];
+			if (node.is_leaf()) {
+				if (visit_leaf(node.offset, node.count)) {
+					return;
+				}
+				continue;
+			}
+
+			uint32_t near_id = node_id + 1;
+			uint32_t far_id = node.offset;
+			float near_t = nodes[near_id].aabb_test(ray, max_t);
+			float far_t = nodes[far_id].aabb_test(ray, max_t);
+			if (far_t < near_t) {
+				std::swap(near_id, far_id);
+				std::swap(near_t, far_t);
+			}
+
+			// Far child goes first, so the near one is popped next
+			if (far_t <= max_t) {
+				stack[stack_size++] = {far_id, far_t};
+			}
+			if (near_t <= max_t) {
+				stack[stack_size++] = {near_id, near_t};
+			}
+		}
+	}
+
+	// Packet version of `traverse_bvh`, `visit_leaf(offset, count, mask)` gets the rays which reach the leaf
+	template<size_t P, typename F>
+	inline void traverse_bvh_packet(
+			const std::vector<bvh_node>& nodes, const ray_packet<P>& packet, const float* max_t, F&& visit_leaf)
+	{
+		if (nodes.empty()) {
+			return;
+		}
+
+		std::pair<uint32_t, unsigned> stack[BVH_MAX_DEPTH + 1];
+		size_t stack_size = 0;
+
+		float root_t;
+		unsigned root_mask = packet_slab_test(packet, nodes[0].aabb_min, nodes[0].aabb_max, max_t, root_t);
+		if (root_mask) {
+			stack[stack_size++] = {0, root_mask};
+		}
+
+		while (stack_size > 0) {
+			auto [node_id, mask] = stack[--stack_size];
+			const bvh_node& node = nodes[node_id];
+
+			if (node.is_leaf()) {
+				visit_leaf(node.offset, node.count, mask);
+				continue;
+			}
+
+			// Closer hits found after the push may drop rays, so masks are refined against the parent ones
+			uint32_t near_id = node_id + 1;
+			uint32_t far_id = node.offset;
+			float near_t, far_t;
+			unsigned near_mask = mask & packet_slab_test(packet, nodes[near_id].aabb_min, nodes[near_id].aabb_max, max_t, near_t);
+			unsigned far_mask = mask & packet_slab_test(packet, nodes[far_id].aabb_min, nodes[far_id].aabb_max, max_t, far_t);
+			if (far_t < near_t) {
+				std::swap(near_id, far_id);
+				std::swap(near_mask, far_mask);
+			}
+
+			if (far_mask) {
+				stack[stack_size++] = {far_id, far_mask};
+			}
+			if (near_mask) {
+				stack[stack_size++] = {near_id, near_mask};
+			}
+		}
+	}
+
+	template<typename VB>
+	inline void bvh<VB>::build(std::vector<triangle<VB>> in_triangles)
+	{
+		std::vector<aabb> primitive_bounds(in_triangles.size());
+		for (size_t i = 0; i < in_triangles.size(); i++) {
+			primitive_bounds[i].grow(in_triangles[i].a);
+			primitive_bounds[i].grow(in_triangles[i].b);
+			primitive_bounds[i].grow(in_triangles[i].c);
+		}
+
+		auto root = builder.build(primitive_bounds);
+
+		nodes.clear();
+		if (root) {
+			flatten_bvh(root.get(), nodes);
+		}
+
+		// Store triangles in leaf order, so every leaf covers a continuous range
+		shading.clear();
+		shading.reserve(in_triangles.size());
+		primitive_order.clear();
+		primitive_order.reserve(in_triangles.size());
+		for (size_t id : builder.get_primitive_order()) {
+			shading.emplace_back(in_triangles[id]);
+			primitive_order.push_back(static_cast<uint32_t>(id));
+		}
+
+		build_triangle_blocks(in_triangles);
+		build_wide_bvh();
+		build_sah_cost = get_sah_cost();
+	}
+
+	template<typename VB>
+	inline void bvh<VB>::refit(const std::vector<triangle<VB>>& in_triangles)
+	{
+		if (in_triangles.size() != shading.size()) {
+			THROW_ERROR("Refit needs the triangles the hierarchy was built from");
+		}
+
+		for (size_t i = 0; i < shading.size(); i++) {
+			const auto& triangle = in_triangles[primitive_order[i]];
+			shading[i] = triangle_shading(triangle);
+			set_block_lane(triangle, primitive_slots[i]);
+		}
+
+		// Children are stored after their parents, so a backward pass sees them first
+		for (size_t id = nodes.size(); id-- > 0;) {
+			auto& node = nodes[id];
+			aabb bounds;
+			if (node.is_leaf()) {
+				uint32_t last = node.offset + (node.count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+				for (uint32_t b = node.offset; b < last; b++) {
+					for (size_t lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+						if (blocks[b].primitive_id[lane] == PRIMITIVE_NONE) {
+							continue;
+						}
+						const auto& triangle = in_triangles[primitive_order[blocks[b].primitive_id[lane]]];
+						bounds.grow(triangle.a);
+						bounds.grow(triangle.b);
+						bounds.grow(triangle.c);
+					}
+				}
+			}
+			else {
+				bounds.grow(aabb{nodes[id + 1].aabb_min, nodes[id + 1].aabb_max});
+				bounds.grow(aabb{nodes[node.offset].aabb_min, nodes[node.offset].aabb_max});
+			}
+			node.aabb_min = bounds.aabb_min;
+			node.aabb_max = bounds.aabb_max;
+		}
+
+		build_wide_bvh();
+	}
+
+	template<typename VB>
+	inline void bvh<VB>::save(std::ostream& stream) const
+	{
+		stream.write(reinterpret_cast<const char*>(&build_sah_cost), sizeof(build_sah_cost));
+		write_array(stream, nodes);
+		write_array(stream, blocks);
+		write_array(stream, shading);
+		write_array(stream, primitive_slots);
+		write_array(stream, primitive_order);
+	}
+
+	template<typename VB>
+	inline bool bvh<VB>::load(std::istream& stream)
+	{
+		stream.read(reinterpret_cast<char*>(&build_sah_cost), sizeof(build_sah_cost));
+		if (!stream || !read_array(stream, nodes) || !read_array(stream, blocks) || !read_array(stream, shading) ||
+			!read_array(stream, primitive_slots) || !read_array(stream, primitive_order)) {
+			return false;
+		}
+		if (primitive_slots.size() != shading.size() || primitive_order.size() != shading.size()) {
+			return false;
+		}
+		// Every index and the depth are checked, so a damaged file can't send traversal or refit
+		// out of bounds nor overflow their fixed size stacks
+		std::vector<uint32_t> depth(nodes.size(), 0);
+		for (size_t id = 0; id < nodes.size(); id++) {
+			const auto& node = nodes[id];
+			if (depth[id] >= BVH_MAX_DEPTH) {
+				return false;
+			}
+			if (node.is_leaf()) {
+				uint64_t block_count = (static_cast<uint64_t>(node.count) + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+				if (node.offset + block_count > blocks.size()) {
+					return false;
+				}
+			}
+			// Children follow their parent, which also rules out cycles
+			else if (id + 1 >= nodes.size() || node.offset <= id || node.offset >= nodes.size()) {
+				return false;
+			}
+			else {
+				depth[id + 1] = std::max(depth[id + 1], depth[id] + 1);
+				depth[node.offset] = std::max(depth[node.offset], depth[id] + 1);
+			}
+		}
+		for (const auto& block : blocks) {
+			for (size_t lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+				if (block.primitive_id[lane] != PRIMITIVE_NONE && block.primitive_id[lane] >= shading.size()) {
+					return false;
+				}
+			}
+		}
+		for (size_t i = 0; i < shading.size(); i++) {
+			if (primitive_slots[i] / TRIANGLE_BLOCK_SIZE >= blocks.size() || primitive_order[i] >= shading.size()) {
+				return false;
+			}
+		}
+
+		build_wide_bvh();
+		return true;
+	}
+
+	template<typename VB>
+	inline void bvh<VB>::build_wide_bvh()
+	{
+		bvh4 = {};
+		bvh8 = {};
+		if (builder.settings.width == 4) {
+			bvh4.build(nodes);
+		}
+		else if (builder.settings.width == 8) {
+			bvh8.build(nodes);
+		}
+	}
+
+	template<typename VB>
+	inline void bvh<VB>::build_triangle_blocks(const std::vector<triangle<VB>>& in_triangles)
+	{
+		// Every leaf gets its own blocks, unused lanes keep zero edges and never hit
+		blocks.clear();
+		primitive_slots.resize(shading.size());
+		for (auto& node : nodes) {
+			if (!node.is_leaf()) {
+				continue;
+			}
+
+			uint32_t first_block = static_cast<uint32_t>(blocks.size());
+			for (uint32_t i = 0; i < node.count; i += TRIANGLE_BLOCK_SIZE) {
+				auto& block = blocks.emplace_back();
+				for (uint32_t lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+					block.primitive_id[lane] = PRIMITIVE_NONE;
+				}
+				for (uint32_t lane = 0; lane < TRIANGLE_BLOCK_SIZE && i + lane < node.count; lane++) {
+					uint32_t primitive_id = node.offset + i + lane;
+					uint32_t slot = static_cast<uint32_t>((blocks.size() - 1) * TRIANGLE_BLOCK_SIZE + lane);
+					primitive_slots[primitive_id] = slot;
+					set_block_lane(in_triangles[primitive_order[primitive_id]], slot);
+					block.primitive_id[lane] = primitive_id;
+				}
+			}
+			node.offset = first_block;
+		}
+	}
+
+	template<typename VB>
+	inline void bvh<VB>::set_block_lane(const triangle<VB>& triangle, uint32_t slot)
+	{
+		auto& block = blocks[slot / TRIANGLE_BLOCK_SIZE];
+		size_t lane = slot % TRIANGLE_BLOCK_SIZE;
+		block.a_x[lane] = triangle.a.x;
+		block.a_y[lane] = triangle.a.y;
+		block.a_z[lane] = triangle.a.z;
+		block.ba_x[lane] = triangle.ba.x;
+		block.ba_y[lane] = triangle.ba.y;
+		block.ba_z[lane] = triangle.ba.z;
+		block.ca_x[lane] = triangle.ca.x;
+		block.ca_y[lane] = triangle.ca.y;
+		block.ca_z[lane] = triangle.ca.z;
+	}
+
+	template<typename VB>
+	inline triangle<VB> bvh<VB>::get_triangle(uint32_t primitive_id) const
+	{
+		const auto& block = blocks[primitive_slots[primitive_id] / TRIANGLE_BLOCK_SIZE];
+		size_t lane = primitive_slots[primitive_id] % TRIANGLE_BLOCK_SIZE;
+		const auto& cold = shading[primitive_id];
+
+		triangle<VB> result;
+		result.a = float3(block.a_x[lane], block.a_y[lane], block.a_z[lane]);
+		result.ba = float3(block.ba_x[lane], block.ba_y[lane], block.ba_z[lane]);
+		result.ca = float3(block.ca_x[lane], block.ca_y[lane], block.ca_z[lane]);
+		result.b = result.a + result.ba;
+		result.c = result.a + result.ca;
+		result.na = cold.na;
+		result.nb = cold.nb;
+		result.nc = cold.nc;
+		result.material_id = cold.material_id;
+		result.shape_id = cold.shape_id;
+		result.primitive_id = cold.primitive_id;
+		return result;
+	}
+
+	template<typename VB>
+	inline const std::vector<triangle_shading>& bvh<VB>::get_shading() const
+	{
+		return shading;
+	}
+
+	template<typename VB>
+	inline aabb bvh<VB>::get_bounds() const
+	{
+		if (nodes.empty()) {
+			return {};
+		}
+		return {nodes[0].aabb_min, nodes[0].aabb_max};
+	}
+
+	template<typename VB>
+	template<size_t P, typename F>
+	inline void bvh<VB>::traverse_packet(const ray_packet<P>& packet, const float* max_t, F&& visit_leaf) const
+	{
+		traverse_bvh_packet(nodes, packet, max_t, visit_leaf);
+	}
+
+	template<typename VB>
+	inline uint32_t bvh<VB>::intersect_leaf(
+			const ray& ray, uint32_t first, uint32_t count, float min_t, payload& payload) const
+	{
+		uint32_t primitive_id = PRIMITIVE_NONE;
+		uint32_t last = first + (count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+		for (uint32_t b = first; b < last; b++) {
+			float t, u, v;
+			int lane = intersect_block(blocks[b], ray, min_t, payload.t, t, u, v);
+			if (lane >= 0) {
+				payload.t = t;
+				payload.bary = float3(1.f - u - v, u, v);
+				primitive_id = blocks[b].primitive_id[lane];
+			}
+		}
+		if (primitive_id != PRIMITIVE_NONE) {
+			payload.primitive_id = primitive_id;
+		}
+		return primitive_id;
+	}
+
+	template<typename VB>
+	inline float bvh<VB>::get_sah_cost() const
+	{
+		if (nodes.empty()) {
+			return 0.f;
+		}
+
+		auto area = [](const bvh_node& node) {
+			return aabb{node.aabb_min, node.aabb_max}.surface_area();
+		};
+
+		float root_area = area(nodes[0]);
+		if (root_area <= 0.f) {
+			return builder.settings.intersection_cost * shading.size();
+		}
+
+		float cost = 0.f;
+		for (const auto& node : nodes) {
+			float probability = area(node) / root_area;
+			if (node.is_leaf()) {
+				cost += probability * builder.settings.intersection_cost * node.count;
+			}
+			else {
+				cost += probability * builder.settings.traversal_cost;
+			}
+		}
+		return cost;
+	}
+
+	template<typename VB>
+	inline float bvh<VB>::get_build_sah_cost() const
+	{
+		return build_sah_cost;
+	}
+
+	template<typename VB>
+	template<typename F>
+	inline void bvh<VB>::traverse(const ray& ray, const float& max_t, F&& visit_leaf) const
+	{
+		if (builder.settings.width == 4) {
+			bvh4.traverse(ray, max_t, visit_leaf);
+			return;
+		}
+		if (builder.settings.width == 8) {
+			bvh8.traverse(ray, max_t, visit_leaf);
+			return;
+		}
+
+		traverse_bvh(nodes, ray, max_t, visit_leaf);
+	}
+
+	template<typename VB>
+	inline void top_level_bvh<VB>::build(std::vector<std::shared_ptr<bvh<VB>>> in_meshes, std::vector<instance> in_instances)
+	{
+		meshes = std::move(in_meshes);
+		instances = std::move(in_instances);
+
+		size_t count = instances.size();
+		inverse_transforms.resize(count);
+		normal_transforms.resize(count);
+		instance_bounds.assign(count, aabb{});
+		identity.resize(count);
+
+		// Instances of empty meshes stay out of the hierarchy
+		std::vector<uint32_t> placed;
+		std::vector<aabb> placed_bounds;
+		for (uint32_t i = 0; i < count; i++) {
+			if (instances[i].mesh_id >= meshes.size()) {
+				THROW_ERROR("Instance " + std::to_string(i) + " refers to a missing mesh");
+			}
+
+			const auto& transform = instances[i].transform;
+			float3x3 linear(transform.x.xyz(), transform.y.xyz(), transform.z.xyz());
+			inverse_transforms[i] = inverse(transform);
+			normal_transforms[i] = transpose(inverse(linear));
+			identity[i] = transform == float4x4(linalg::identity);
+
+			aabb mesh_bounds = meshes[instances[i].mesh_id]->get_bounds();
+			if (mesh_bounds.aabb_min.x > mesh_bounds.aabb_max.x) {
+				continue;
+			}
+			for (int corner = 0; corner < 8; corner++) {
+				float3 point(
+					corner & 1 ? mesh_bounds.aabb_max.x : mesh_bounds.aabb_min.x,
+					corner & 2 ? mesh_bounds.aabb_max.y : mesh_bounds.aabb_min.y,
+					corner & 4 ? mesh_bounds.aabb_max.z : mesh_bounds.aabb_min.z);
+				instance_bounds[i].grow(mul(transform, float4(point, 1.f)).xyz());
+			}
+			placed.push_back(i);
+			placed_bounds.push_back(instance_bounds[i]);
+		}
+
+		auto root = builder.build(placed_bounds);
+
+		nodes.clear();
+		if (root) {
+			flatten_bvh(root.get(), nodes);
+		}
+
+		instance_order.clear();
+		for (size_t id : builder.get_primitive_order()) {
+			instance_order.push_back(placed[id]);
+		}
+	}
+
+	template<typename VB>
+	template<typename F>
+	inline void top_level_bvh<VB>::traverse(const ray& ray, const float& max_t, F&& visit_leaf) const
+	{
+		traverse_bvh(nodes, ray, max_t, [&](uint32_t first, uint32_t count) {
+			for (uint32_t i = first; i < first + count; i++) {
+				uint32_t instance_id = instance_order[i];
+				cg::renderer::ray object_ray = identity[instance_id] ? ray : to_object_space(instance_id, ray);
+
+				bool stop = false;
+				meshes[instances[instance_id].mesh_id]->traverse(object_ray, max_t, [&](uint32_t mesh_first, uint32_t mesh_count) {
+					stop = visit_leaf(instance_id, object_ray, mesh_first, mesh_count);
+					return stop;
+				});
+				if (stop) {
+					return true;
+				}
+			}
+			return false;
+		});
+	}
+
+	template<typename VB>
+	template<size_t P, typename F>
+	inline void top_level_bvh<VB>::traverse_packet(
+			const ray_packet<P>& packet, const ray* rays, const float* max_t, F&& visit_leaf) const
+	{
+		traverse_bvh_packet(nodes, packet, max_t, [&](uint32_t first, uint32_t count, unsigned mask) {
+			for (uint32_t i = first; i < first + count; i++) {
+				uint32_t instance_id = instance_order[i];
+				const auto& mesh = *meshes[instances[instance_id].mesh_id];
+
+				// Rays outside of the instance box may still enter boxes of its mesh
+				auto visit_mesh_leaf = [&](const ray* object_rays) {
+					return [&, object_rays](uint32_t mesh_first, uint32_t mesh_count, unsigned mesh_mask) {
+						if (mesh_mask & mask) {
+							visit_leaf(instance_id, object_rays, mesh_first, mesh_count, mesh_mask & mask);
+						}
+					};
+				};
+
+				if (identity[instance_id]) {
+					mesh.traverse_packet(packet, max_t, visit_mesh_leaf(rays));
+					continue;
+				}
+
+				ray object_rays[P];
+				for (size_t r = 0; r < P; r++) {
+					object_rays[r] = to_object_space(instance_id, rays[r]);
+				}
+				ray_packet<P> object_packet(object_rays);
+				if (object_packet.coherent) {
+					mesh.traverse_packet(object_packet, max_t, visit_mesh_leaf(object_rays));
+					continue;
+				}
+
+				for (size_t r = 0; r < P; r++) {
+					if (!(mask & (1u << r))) {
+						continue;
+					}
+					mesh.traverse(object_rays[r], max_t[r], [&](uint32_t mesh_first, uint32_t mesh_count) {
+						visit_leaf(instance_id, object_rays, mesh_first, mesh_count, 1u << r);
+						return false;
+					});
+				}
+			}
+		});
+	}
+
+	template<typename VB>
+	inline uint32_t top_level_bvh<VB>::intersect_leaf(uint32_t instance_id, const ray& object_ray, uint32_t first,
+													 uint32_t count, float min_t, payload& payload) const
+	{
+		uint32_t primitive_id = meshes[instances[instance_id].mesh_id]->intersect_leaf(object_ray, first, count, min_t, payload);
+		if (primitive_id != PRIMITIVE_NONE) {
+			payload.instance_id = instance_id;
+		}
+		return primitive_id;
+	}
+
+	template<typename VB>
+	inline triangle<VB> top_level_bvh<VB>::get_triangle(uint32_t instance_id, uint32_t primitive_id) const
+	{
+		triangle<VB> result = meshes[instances[instance_id].mesh_id]->get_triangle(primitive_id);
+		if (identity[instance_id]) {
+			return result;
+		}
+
+		const auto& transform = instances[instance_id].transform;
+		result.a = mul(transform, float4(result.a, 1.f)).xyz();
+		result.b = mul(transform, float4(result.b, 1.f)).xyz();
+		result.c = mul(transform, float4(result.c, 1.f)).xyz();
+		result.ba = result.b - result.a;
+		result.ca = result.c - result.a;
+
+		const auto& normal_transform = normal_transforms[instance_id];
+		result.na = normalize(mul(normal_transform, result.na));
+		result.nb = normalize(mul(normal_transform, result.nb));
+		result.nc = normalize(mul(normal_transform, result.nc));
+		return result;
+	}
+
+	template<typename VB>
+	inline ray top_level_bvh<VB>::to_object_space(uint32_t instance_id, const ray& ray) const
+	{
+		const auto& inverse_transform = inverse_transforms[instance_id];
+		cg::renderer::ray result;
+		result.position = mul(inverse_transform, float4(ray.position, 1.f)).xyz();
+		// Left unnormalized, so a distance along the ray is the same in both spaces
+		result.direction = mul(inverse_transform, float4(ray.direction, 0.f)).xyz();
+		result.inv_direction = float3(1.f) / result.direction;
+		return result;
+	}
+
+	template<typename VB>
+	inline const std::vector<std::shared_ptr<bvh<VB>>>& top_level_bvh<VB>::get_meshes() const
+	{
+		return meshes;
+	}
+
+	template<typename VB>
+	inline const std::vector<instance>& top_level_bvh<VB>::get_instances() const
+	{
+		return instances;
+	}
+
+	template<typename VB>
+	inline aabb top_level_bvh<VB>::get_bounds() const
+	{
+		if (nodes.empty()) {
+			return {};
+		}
+		return {nodes[0].aabb_min, nodes[0].aabb_max};
+	}
+
+	template<typename VB>
+	inline float top_level_bvh<VB>::get_sah_cost() const
+	{
+		if (nodes.empty()) {
+			return 0.f;
+		}
+
+		float root_area = aabb{nodes[0].aabb_min, nodes[0].aabb_max}.surface_area();
+		auto probability = [&](const aabb& bounds) {
+			return root_area > 0.f ? bounds.surface_area() / root_area : 1.f;
+		};
+
+		float cost = 0.f;
+		for (const auto& node : nodes) {
+			if (!node.is_leaf()) {
+				cost += probability({node.aabb_min, node.aabb_max}) * builder.settings.traversal_cost;
+				continue;
+			}
+			for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+				uint32_t instance_id = instance_order[i];
+				cost += probability(instance_bounds[instance_id]) * meshes[instances[instance_id].mesh_id]->get_sah_cost();
+			}
+		}
+		return cost;
+	}
+
+	// Scalar fallback which tests children one by one.
+	// Returns a mask of hit children and writes their entry distances
+	template<size_t N>
+	inline unsigned wide_slab_test(const wide_bvh_node<N>& node, const ray& ray, float max_t, float* t_enter)
+	{
+		unsigned mask = 0;
+		for (size_t i = 0; i < N; i++) {
+			float3 aabb_min(node.min_x[i], node.min_y[i], node.min_z[i]);
+			float3 aabb_max(node.max_x[i], node.max_y[i], node.max_z[i]);
+			t_enter[i] = slab_test(ray, aabb_min, aabb_max, max_t);
+			if (t_enter[i] <= max_t) {
+				mask |= 1u << i;
+			}
+		}
+		return mask;
+	}
+
+#ifdef RAYTRACER_SSE
+	inline unsigned wide_slab_test(const wide_bvh_node<4>& node, const ray& ray, float max_t, float* t_enter)
+	{
+		__m128 t0, t1;
+		__m128 tmin = _mm_setzero_ps();
+		__m128 tmax = _mm_set1_ps(max_t);
+
+		auto slab = [&](const float* aabb_min, const float* aabb_max, float position, float inv_direction) {
+			__m128 p = _mm_set1_ps(position);
+			__m128 inv = _mm_set1_ps(inv_direction);
+			t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(aabb_min), p), inv);
+			t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(aabb_max), p), inv);
+			tmin = _mm_max_ps(tmin, _mm_min_ps(t0, t1));
+			tmax = _mm_min_ps(tmax, _mm_max_ps(t0, t1));
+		};
+		slab(node.min_x, node.max_x, ray.position.x, ray.inv_direction.x);
+		slab(node.min_y, node.max_y, ray.position.y, ray.inv_direction.y);
+		slab(node.min_z, node.max_z, ray.position.z, ray.inv_direction.z);
+
+		_mm_storeu_ps(t_enter, tmin);
+		return static_cast<unsigned>(_mm_movemask_ps(_mm_cmple_ps(tmin, tmax)));
+	}
+#endif
+
+#ifdef RAYTRACER_AVX2
+	inline unsigned wide_slab_test(const wide_bvh_node<8>& node, const ray& ray, float max_t, float* t_enter)
+	{
+		__m256 t0, t1;
+		__m256 tmin = _mm256_setzero_ps();
+		__m256 tmax = _mm256_set1_ps(max_t);
+
+		auto slab = [&](const float* aabb_min, const float* aabb_max, float position, float inv_direction) {
+			__m256 p = _mm256_set1_ps(position);
+			__m256 inv = _mm256_set1_ps(inv_direction);
+			t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(aabb_min), p), inv);
+			t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(aabb_max), p), inv);
+			tmin = _mm256_max_ps(tmin, _mm256_min_ps(t0, t1));
+			tmax = _mm256_min_ps(tmax, _mm256_max_ps(t0, t1));
+		};
+		slab(node.min_x, node.max_x, ray.position.x, ray.inv_direction.x);
+		slab(node.min_y, node.max_y, ray.position.y, ray.inv_direction.y);
+		slab(node.min_z, node.max_z, ray.position.z, ray.inv_direction.z);
+
+		_mm256_storeu_ps(t_enter, tmin);
+		return static_cast<unsigned>(_mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ)));
+	}
+#endif
+
+	template<size_t N>
+	inline void wide_bvh<N>::build(const std::vector<bvh_node>& binary_nodes)
+	{
+		nodes.clear();
+		if (!binary_nodes.empty()) {
+			collapse(binary_nodes, 0);
+		}
+	}
+
+	template<size_t N>
+	inline uint32_t wide_bvh<N>::collapse(const std::vector<bvh_node>& binary_nodes, uint32_t binary_id)
+	{
+		// Pulls grandchildren up while there are free slots, opening the largest inner child first
+		uint32_t children[N];
+		size_t child_count = 0;
+		const bvh_node& binary_node = binary_nodes[binary_id];
+		if (binary_node.is_leaf()) {
+			children[child_count++] = binary_id;
+		}
+		else {
+			children[child_count++] = binary_id + 1;
+			children[child_count++] = binary_node.offset;
+		}
+
+		auto area = [&](uint32_t id) {
+			return aabb{binary_nodes[id].aabb_min, binary_nodes[id].aabb_max}.surface_area();
+		};
+
+		while (child_count < N) {
+			int largest = -1;
+			for (size_t i = 0; i < child_count; i++) {
+				if (!binary_nodes[children[i]].is_leaf() && (largest < 0 || area(children[i]) > area(children[largest]))) {
+					largest = static_cast<int>(i);
+				}
+			}
+			if (largest < 0) {
+				break;
+			}
+			uint32_t opened = children[largest];
+			children[largest] = opened + 1;
+			children[child_count++] = binary_nodes[opened].offset;
+		}
+
+		uint32_t id = static_cast<uint32_t>(nodes.size());
+		nodes.emplace_back();
+
+		for (size_t i = 0; i < N; i++) {
+			// Empty slots get a box at infinity, which no ray can enter
+			float3 aabb_min(std::numeric_limits<float>::infinity());
+			float3 aabb_max(std::numeric_limits<float>::infinity());
+			uint32_t offset = 0;
+			uint32_t count = 0;
+
+			if (i < child_count) {
+				const bvh_node& child = binary_nodes[children[i]];
+				aabb_min = child.aabb_min;
+				aabb_max = child.aabb_max;
+				if (child.is_leaf()) {
+					offset = child.offset;
+					count = child.count;
+				}
+				else {
+					offset = collapse(binary_nodes, children[i]);
+				}
+			}
+
+			// Recursion above may reallocate the node list
+			auto& node = nodes[id];
+			node.min_x[i] = aabb_min.x;
+			node.min_y[i] = aabb_min.y;
+			node.min_z[i] = aabb_min.z;
+			node.max_x[i] = aabb_max.x;
+			node.max_y[i] = aabb_max.y;
+			node.max_z[i] = aabb_max.z;
+			node.offset[i] = offset;
+			node.count[i] = count;
+		}
+		return id;
+	}
+
+	template<size_t N>
+	template<typename F>
+	inline void wide_bvh<N>::traverse(const ray& ray, const float& max_t, F&& visit_leaf) const
+	{
+		if (nodes.empty()) {
+			return;
+		}
+
+		struct entry
+		{
+			uint32_t offset;
+			uint32_t count;
+			float t;
+		};
+		entry stack[BVH_MAX_DEPTH * N];
+		size_t stack_size = 0;
+		// Bounds of the root are tested together with its children
+		stack[stack_size++] = {0, 0, 0.f};
+
+		while (stack_size > 0) {
+			entry current = stack[--stack_size];
+			// A closer hit was found after the node had been pushed
+			if (current.t > max_t) {
+				continue;
+			}
+
+			if (current.count > 0) {
+				if (visit_leaf(current.offset, current.count)) {
+					return;
+				}
+				continue;
+			}
+
+			const auto& node = nodes[current.offset];
+			alignas(4 * N) float t_enter[N];
+			unsigned mask = wide_slab_test(node, ray, max_t, t_enter);
+
+			// Hit children are pushed sorted from far to near, so the nearest one is popped next
+			size_t first = stack_size;
+			for (size_t i = 0; i < N; i++) {
+				if (!(mask & (1u << i))) {
+					continue;
+				}
+				entry child{node.offset[i], node.count[i], t_enter[i]};
+				size_t j = stack_size++;
+				while (j > first && stack[j - 1].t < child.t) {
+					stack[j] = stack[j - 1];
+					j--;
+				}
+				stack[j] = child;
+			}
+		}
 	}
 
 }// namespace cg::renderer
\ No newline at end of file
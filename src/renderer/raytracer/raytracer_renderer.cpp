@@ -1,11 +1,49 @@
 #include "raytracer_renderer.h"
 
+#include "utils/error_handler.h"
 #include "utils/resource_utils.h"
 #include "utils/timer.h"
 
+#include <fstream>
 #include <iostream>
+#include <sstream>
 
 
+cg::renderer::payload cg::renderer::black_miss_shader::operator()(const ray& ray) const
+{
+	payload payload{};
+	payload.color = {0.f, 0.f, 0.f};
+	// payload.color = {0.f, 0.f, (ray.direction.y + 1.f) * 0.5f};
+	return payload;
+}
+
+cg::renderer::bounce cg::renderer::diffuse_bounce_shader::operator()(
+		const ray& ray, const payload& payload, const triangle<cg::vertex>& triangle, sampler& sampler) const
+{
+	float3 position = ray.position + payload.t * ray.direction;
+	float3 normal = normalize(
+		payload.bary.x * triangle.na + payload.bary.y * triangle.nb + payload.bary.z * triangle.nc 
+	);
+
+	// Both sides of a triangle reflect
+	if (dot(normal, ray.direction) > 0.f) {
+		normal = -normal;
+	}
+
+	const auto& material = tracer->get_material(triangle.material_id);
+	bounce result;
+	result.emitted = material.emissive;
+	result.direct = evaluate_lambert(material.diffuse) * tracer->sample_direct_light(position, normal, sampler);
+	result.sampled_lights = true;
+
+	bsdf_sample sample = sample_lambert(normal, material.diffuse, sampler.get_2d());
+	result.next_ray = cg::renderer::ray(position, sample.direction);
+	result.attenuation = sample.weight;
+	result.pdf = sample.pdf;
+	result.terminated = sample.pdf == 0.f;
+	return result;
+}
+
 void cg::renderer::ray_tracing_renderer::init()
 {
 
@@ -14,22 +52,88 @@ void cg::renderer::ray_tracing_renderer::init()
 	
 	render_target =  std::make_shared<cg::resource<cg::unsigned_color>>(settings->width, settings->height);
 
-	raytracer = std::make_shared<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>>();
+	raytracer = std::make_shared<path_tracer>();
+	raytracer->bounce_shader.tracer = raytracer.get();
 
 	raytracer->set_render_target(render_target);
 	raytracer->set_viewport(settings->width, settings->height);
+	if (settings->crop[2] > 0 && settings->crop[3] > 0) {
+		raytracer->set_crop(settings->crop[0], settings->crop[1], settings->crop[2], settings->crop[3]);
+	}
+	raytracer->packet_size = settings->packet_size;
+	raytracer->tile_size = settings->tile_size;
+	raytracer->wavefront = settings->wavefront;
+	raytracer->adaptive_threshold = settings->adaptive_threshold;
+	raytracer->min_samples = settings->min_samples;
+	raytracer->russian_roulette_depth = settings->russian_roulette_depth;
+	raytracer->denoise = settings->denoise;
+	raytracer->denoiser.settings.iterations = settings->denoise_iterations;
+	raytracer->checkpoint_interval = settings->checkpoint_interval;
+	raytracer->checkpoint_path = settings->checkpoint_path;
+	raytracer->seed = settings->seed;
+	raytracer->sampler_kind = settings->sampler == "random" ? sampler_type::random : sampler_type::sobol;
 	raytracer->set_vertex_buffers(model->get_vertex_buffers());
 	raytracer->set_index_buffers(model->get_index_buffers());
+	raytracer->set_materials(model->get_materials());
+	load_instances();
+	raytracer->bvh_settings.bins = settings->bvh_bins;
+	raytracer->bvh_settings.max_leaf_size = settings->bvh_max_leaf_size;
+	raytracer->bvh_settings.width = settings->bvh_width;
+	raytracer->acceleration_cache_path = settings->bvh_cache_path;
+
+	// The point light stands in for the ceiling lamp of the Cornell box. Models with emissive
+	// surfaces are lit by those alone, otherwise the lamp would be counted twice
+	const auto& materials = model->get_materials();
+	bool has_emitters = false;
+	for (const auto& vertex_buffer : model->get_vertex_buffers()) {
+		for (size_t i = 0; i < vertex_buffer->count() && !has_emitters; i++) {
+			has_emitters = luminance(materials[vertex_buffer->item(i).material_id].emissive) > 0.f;
+		}
+	}
+	if (!has_emitters) {
+		lights.push_back({
+			float3{0.f, 1.58f, -0.03f},
+			float3{0.78f, 0.78f, 0.78f}
+		});
+	}
+}
 
-	lights.push_back({
-		float3{0.f, 1.58f, -0.03f},
-		float3{0.78f, 0.78f, 0.78f}
-	});
+void cg::renderer::ray_tracing_renderer::load_instances()
+{
+	if (settings->instances_path.empty()) {
+		return;
+	}
 
-	shadow_raytracer = std::make_shared<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>>();
+	std::ifstream file(settings->instances_path);
+	if (!file) {
+		THROW_ERROR("Can't open instances file " + settings->instances_path.string());
+	}
 
-	shadow_raytracer->set_vertex_buffers(model->get_vertex_buffers());
-	shadow_raytracer->set_index_buffers(model->get_index_buffers());
+	size_t shape_count = model->get_index_buffers().size();
+	std::string line;
+	for (size_t line_number = 1; std::getline(file, line); line_number++) {
+		std::istringstream stream(line);
+		instance placement;
+		if (!(stream >> placement.mesh_id)) {
+			// Blank lines and comments
+			continue;
+		}
+
+		float rows[3][4];
+		for (auto& row : rows) {
+			for (float& value : row) {
+				stream >> value;
+			}
+		}
+		if (!stream || placement.mesh_id >= shape_count) {
+			THROW_ERROR("Bad instance at line " + std::to_string(line_number) + " of " + settings->instances_path.string());
+		}
+		for (int column = 0; column < 4; column++) {
+			placement.transform[column] = float4(rows[0][column], rows[1][column], rows[2][column], column == 3 ? 1.f : 0.f);
+		}
+		raytracer->instances.push_back(placement);
+	}
+	std::cout << "Placed " << raytracer->instances.size() << " instances of " << shape_count << " shapes\n";
 }
 
 void cg::renderer::ray_tracing_renderer::destroy() {}
@@ -39,53 +143,18 @@ void cg::renderer::ray_tracing_renderer::update() {}
 void cg::renderer::ray_tracing_renderer::render()
 {
 	raytracer->clear_render_target({0, 0, 0});
+	if (settings->resume && std::filesystem::exists(settings->checkpoint_path)) {
+		raytracer->load_checkpoint(settings->checkpoint_path);
+		std::cout << "Resuming from " << settings->checkpoint_path << "\n";
+	}
 
-	raytracer->miss_shader = [](const ray& ray) {
-		payload payload{};
-		payload.color = {0.f, 0.f, 0.f};
-		// payload.color = {0.f, 0.f, (ray.direction.y + 1.f) * 0.5f};
-		return payload;
-	};
-
-	std::random_device random_device;
-	std::mt19937 random_generator(random_device());
-	std::uniform_real_distribution<float> uniform(-1.f, 1.f);
-
-	raytracer->closest_hit_shader = [&](const ray& ray, payload& payload, const triangle<cg::vertex>& triangle, size_t depth) {
-		float3 position = ray.position + payload.t * ray.direction;
-		float3 normal = normalize(
-			payload.bary.x * triangle.na + payload.bary.y * triangle.nb + payload.bary.z * triangle.nc 
-		);
-		float3 result_color = triangle.emissive;
-
-		float3 random_direction(uniform(random_generator), uniform(random_generator), uniform(random_generator));
-
-		// If random direction is not in semisphere
-		if (dot(normal, random_direction) < 0.f) {
-			random_direction = -random_direction;
-		}
-
-		cg::renderer::ray to_next_object(position, random_direction);
-		auto next_payload = raytracer->trace_ray(to_next_object, depth);
-		result_color += triangle.diffuse * next_payload.color.to_float3() * std::max(dot(normal, to_next_object.direction), 0.f);
-
-		payload.color = cg::color::from_float3(result_color);
-		return payload;
-	};
-
-	raytracer->build_acceleration_structure();
-
-	shadow_raytracer->miss_shader = [](const ray& ray) {
-		payload payload{};
-		payload.t = -1;
-		return payload;
-	};
-
-	shadow_raytracer->any_hit_shader = [](const ray& ray, payload& payload, const triangle<cg::vertex>& triangle) {
-		return payload;
-	};
+	raytracer->lights = lights;
 
-	shadow_raytracer->acceleration_structures = raytracer->acceleration_structures;
+	{
+		cg::utils::timer t("Acceleration structure build");
+		raytracer->build_acceleration_structure();
+		t.add_detail("SAH cost " + std::to_string(raytracer->acceleration_structure->get_sah_cost()));
+	}
 
 	{
 		cg::utils::timer t("Ray generation");
@@ -93,10 +162,55 @@ void cg::renderer::ray_tracing_renderer::render()
 		raytracer->ray_generation(
 			camera->get_position(), camera->get_direction(),
 			camera->get_right(), camera->get_up(),
-			settings->raytracing_depth, settings->accumulation_num
+			settings->raytracing_depth,
+			settings->adaptive_threshold > 0.f ? settings->max_samples : settings->accumulation_num
 		);
 	}
 
+	// A region job hands its accumulation over to the merge tool
+	bool cropped = settings->crop[2] > 0 && settings->crop[3] > 0;
+	if (cropped && settings->checkpoint_interval == 0) {
+		raytracer->save_checkpoint(settings->checkpoint_path);
+	}
+
 	cg::utils::save_resource(*render_target, settings->result_path);
+	if (settings->aov) {
+		save_aovs();
+	}
+}
+
+void cg::renderer::ray_tracing_renderer::save_aovs() const
+{
+	auto aovs = raytracer->get_aov_buffers();
+	cg::resource<cg::unsigned_color> image(settings->width, settings->height);
+	auto save = [&](const std::string& name, auto to_color) {
+		for (size_t i = 0; i < image.count(); i++) {
+			image.item(i) = cg::unsigned_color::from_float3(to_color(i));
+		}
+		auto path = settings->result_path;
+		path.replace_filename(path.stem().string() + "_" + name + path.extension().string());
+		cg::utils::save_resource(image, path);
+	};
+
+	float max_depth = 0.f;
+	unsigned int max_samples = 1;
+	for (size_t i = 0; i < image.count(); i++) {
+		max_depth = std::max(max_depth, aovs.depth->item(i));
+		max_samples = std::max(max_samples, aovs.sample_count->item(i));
+	}
+	// Neighbouring IDs get unrelated colors
+	auto id_color = [](uint32_t id) {
+		if (id == PRIMITIVE_NONE) {
+			return float3(0.f);
+		}
+		uint32_t h = hash(id);
+		return float3(h & 0xff, (h >> 8) & 0xff, (h >> 16) & 0xff) / 255.f;
+	};
 
+	save("normal", [&](size_t i) { return aovs.depth->item(i) > 0.f ? aovs.normal->item(i) * 0.5f + 0.5f : float3(0.f); });
+	save("albedo", [&](size_t i) { return sqrt(aovs.albedo->item(i)); });
+	save("depth", [&](size_t i) { return float3(max_depth > 0.f ? aovs.depth->item(i) / max_depth : 0.f); });
+	save("shape_id", [&](size_t i) { return id_color(aovs.id->item(i).x); });
+	save("primitive_id", [&](size_t i) { return id_color(aovs.id->item(i).y); });
+	save("sample_count", [&](size_t i) { return float3(static_cast<float>(aovs.sample_count->item(i)) / max_samples); });
 }
\ No newline at end of file
@@ -5,6 +5,25 @@
 
 namespace cg::renderer
 {
+	struct black_miss_shader
+	{
+		payload operator()(const ray& ray) const;
+	};
+
+	struct diffuse_bounce_shader;
+
+	// Shaders are compiled into the trace loops instead of being called through std::function
+	using path_tracer = raytracer<cg::vertex, cg::unsigned_color,
+								  static_shaders<black_miss_shader, no_shader, no_shader, diffuse_bounce_shader>>;
+
+	// Lambertian surfaces lit by sampled lights and by a cosine-weighted bounce
+	struct diffuse_bounce_shader
+	{
+		bounce operator()(const ray& ray, const payload& payload, const triangle<cg::vertex>& triangle, sampler& sampler) const;
+
+		const path_tracer* tracer = nullptr;
+	};
+
 	class ray_tracing_renderer : public renderer
 	{
 	public:
@@ -15,10 +34,13 @@ namespace cg::renderer
 		virtual void render();
 
 	protected:
+		void load_instances();
+		// Writes every AOV as an image named after `result_path`, e.g. result_normal.png
+		void save_aovs() const;
+
 		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
 
-		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> raytracer;
-		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> shadow_raytracer;
+		std::shared_ptr<path_tracer> raytracer;
 
 		std::vector<cg::renderer::light> lights;
 	};
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <linalg.h>
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+	// PCG32 generator by M. E. O'Neill: 16 bytes of state and independent streams
+	class pcg32
+	{
+	public:
+		pcg32(uint64_t seed = 0x853c49e6748fea9bull, uint64_t stream = 0xda3e39cb94b95bdbull);
+
+		uint32_t next_uint();
+		// Uniform value in [0, 1)
+		float next_float();
+
+	protected:
+		uint64_t state = 0;
+		uint64_t increment;
+	};
+
+	enum class sampler_type
+	{
+		random,
+		sobol
+	};
+
+	// Source of random values for one sample of one pixel. Values depend only on the seed,
+	// the pixel and the sample index, so images don't change with the number of threads
+	class sampler
+	{
+	public:
+		sampler() = default;
+		sampler(sampler_type type, uint32_t seed, uint32_t pixel, uint32_t sample_index);
+
+		float get_1d();
+		float2 get_2d();
+
+	protected:
+		// Every request takes the next dimension pair of an Owen-scrambled 2D Sobol sequence
+		float2 get_sobol_2d(uint32_t dimension_seed) const;
+
+		sampler_type type = sampler_type::random;
+		uint32_t seed = 0;
+		uint32_t pixel = 0;
+		uint32_t sample_index = 0;
+		uint32_t dimension = 0;
+		pcg32 random;
+	};
+
+	// Integer hash by Chris Wellons (lowbias32)
+	inline uint32_t hash(uint32_t value)
+	{
+		value ^= value >> 16;
+		value *= 0x7feb352du;
+		value ^= value >> 15;
+		value *= 0x846ca68bu;
+		value ^= value >> 16;
+		return value;
+	}
+
+	inline uint32_t hash(uint32_t a, uint32_t b)
+	{
+		return hash(a ^ (hash(b) + 0x9e3779b9u + (a << 6) + (a >> 2)));
+	}
+
+	inline uint32_t reverse_bits(uint32_t value)
+	{
+		value = (value << 16) | (value >> 16);
+		value = ((value & 0x00ff00ffu) << 8) | ((value & 0xff00ff00u) >> 8);
+		value = ((value & 0x0f0f0f0fu) << 4) | ((value & 0xf0f0f0f0u) >> 4);
+		value = ((value & 0x33333333u) << 2) | ((value & 0xccccccccu) >> 2);
+		value = ((value & 0x55555555u) << 1) | ((value & 0xaaaaaaaau) >> 1);
+		return value;
+	}
+
+	// Hash-based Owen scrambling from "Practical Hash-based Owen Scrambling" by B. Burley
+	inline uint32_t nested_uniform_scramble(uint32_t value, uint32_t seed)
+	{
+		value = reverse_bits(value);
+		value += seed;
+		value ^= value * 0x6c50b47cu;
+		value ^= value * 0xb82f1e52u;
+		value ^= value * 0xc7afe638u;
+		value ^= value * 0x8d22f6e6u;
+		return reverse_bits(value);
+	}
+
+	inline float to_unit_float(uint32_t value)
+	{
+		return std::min(value * (1.f / 4294967296.f), 0x1.fffffep-1f);
+	}
+
+	inline pcg32::pcg32(uint64_t seed, uint64_t stream)
+	{
+		increment = (stream << 1u) | 1u;
+		next_uint();
+		state += seed;
+		next_uint();
+	}
+
+	inline uint32_t pcg32::next_uint()
+	{
+		uint64_t old_state = state;
+		state = old_state * 6364136223846793005ull + increment;
+		uint32_t xorshifted = static_cast<uint32_t>(((old_state >> 18u) ^ old_state) >> 27u);
+		uint32_t rotation = static_cast<uint32_t>(old_state >> 59u);
+		return (xorshifted >> rotation) | (xorshifted << ((~rotation + 1u) & 31));
+	}
+
+	inline float pcg32::next_float()
+	{
+		return to_unit_float(next_uint());
+	}
+
+	inline sampler::sampler(sampler_type type, uint32_t seed, uint32_t pixel, uint32_t sample_index) :
+		type(type), seed(seed), pixel(pixel), sample_index(sample_index),
+		random((static_cast<uint64_t>(hash(seed, sample_index)) << 32) | pixel, hash(pixel, seed))
+	{
+	}
+
+	inline float sampler::get_1d()
+	{
+		if (type == sampler_type::sobol) {
+			return get_sobol_2d(hash(seed, dimension++)).x;
+		}
+		return random.next_float();
+	}
+
+	inline float2 sampler::get_2d()
+	{
+		if (type == sampler_type::sobol) {
+			return get_sobol_2d(hash(seed, dimension++));
+		}
+		float x = random.next_float();
+		return float2(x, random.next_float());
+	}
+
+	inline float2 sampler::get_sobol_2d(uint32_t dimension_seed) const
+	{
+		// Shuffles the order of points per pixel and dimension pair, so pairs don't correlate
+		uint32_t index = nested_uniform_scramble(sample_index, hash(pixel, dimension_seed));
+
+		// The first two Sobol dimensions: van der Corput and its (0,2)-sequence companion
+		uint32_t x = reverse_bits(index);
+		uint32_t y = 0;
+		for (uint32_t direction = 1u << 31; index; index >>= 1, direction ^= direction >> 1) {
+			if (index & 1u) {
+				y ^= direction;
+			}
+		}
+
+		return float2(
+			to_unit_float(nested_uniform_scramble(x, hash(dimension_seed, 0x68bc21ebu))),
+			to_unit_float(nested_uniform_scramble(y, hash(dimension_seed, 0x02e5be93u)))
+		);
+	}
+}// namespace cg::renderer
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cmath>
+#include <linalg.h>
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+	constexpr float PI = 3.14159265358979323846f;
+
+	// Direction chosen by a BSDF with the weight f * cos / pdf of the estimator
+	struct bsdf_sample
+	{
+		float3 direction;
+		float3 weight;
+		float pdf;
+	};
+
+	// Tangent and bitangent around a unit normal, "Building an Orthonormal Basis, Revisited" by Duff et al.
+	inline void build_orthonormal_basis(const float3& normal, float3& tangent, float3& bitangent)
+	{
+		float sign = std::copysign(1.f, normal.z);
+		float a = -1.f / (sign + normal.z);
+		float b = normal.x * normal.y * a;
+		tangent = float3(1.f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
+		bitangent = float3(b, sign + normal.y * normal.y * a, -normal.y);
+	}
+
+	inline float3 to_world(const float3& local, const float3& normal)
+	{
+		float3 tangent, bitangent;
+		build_orthonormal_basis(normal, tangent, bitangent);
+		return local.x * tangent + local.y * bitangent + local.z * normal;
+	}
+
+	// Shirley-Chiu concentric mapping, keeps stratification of the input points
+	inline float2 sample_concentric_disk(float2 u)
+	{
+		float2 offset = 2.f * u - 1.f;
+		if (offset.x == 0.f && offset.y == 0.f) {
+			return float2(0.f);
+		}
+
+		float radius, theta;
+		if (std::abs(offset.x) > std::abs(offset.y)) {
+			radius = offset.x;
+			theta = PI / 4.f * (offset.y / offset.x);
+		}
+		else {
+			radius = offset.y;
+			theta = PI / 2.f - PI / 4.f * (offset.x / offset.y);
+		}
+		return radius * float2(std::cos(theta), std::sin(theta));
+	}
+
+	// Local direction around +z with pdf cos(theta) / pi
+	inline float3 sample_cosine_hemisphere(float2 u)
+	{
+		float2 disk = sample_concentric_disk(u);
+		float z = std::sqrt(std::max(0.f, 1.f - disk.x * disk.x - disk.y * disk.y));
+		return float3(disk.x, disk.y, z);
+	}
+
+	inline float cosine_hemisphere_pdf(float cos_theta)
+	{
+		return std::max(cos_theta, 0.f) / PI;
+	}
+
+	// Barycentric coordinates of b and c for a point spread uniformly over a triangle
+	inline float2 sample_triangle(float2 u)
+	{
+		float root = std::sqrt(u.x);
+		return float2(root * (1.f - u.y), root * u.y);
+	}
+
+	// Lambertian BSDF f = albedo / pi, sampled proportionally to the cosine, so the weight is the albedo
+	inline bsdf_sample sample_lambert(const float3& normal, const float3& albedo, float2 u)
+	{
+		float3 local = sample_cosine_hemisphere(u);
+		bsdf_sample result;
+		result.direction = to_world(local, normal);
+		result.pdf = cosine_hemisphere_pdf(local.z);
+		result.weight = result.pdf > 0.f ? albedo : float3(0.f);
+		return result;
+	}
+
+	inline float3 evaluate_lambert(const float3& albedo)
+	{
+		return albedo / PI;
+	}
+}// namespace cg::renderer
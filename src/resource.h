@@ -22,6 +22,8 @@ namespace cg
 		const T* get_data();
 		T& item(size_t item);
 		T& item(size_t x, size_t y);
+		const T& item(size_t item) const;
+		const T& item(size_t x, size_t y) const;
 
 		size_t size_bytes() const;
 		size_t count() const;
@@ -81,6 +83,16 @@ namespace cg
 		return data.at(x + stride * y);
 	}
 	template<typename T>
+	inline const T& resource<T>::item(size_t item) const
+	{
+		return data.at(item);
+	}
+	template<typename T>
+	inline const T& resource<T>::item(size_t x, size_t y) const
+	{
+		return data.at(x + stride * y);
+	}
+	template<typename T>
 	inline size_t resource<T>::size_bytes() const
 	{
 		return data.size() * item_size;
@@ -145,6 +157,14 @@ namespace cg
 	};
 
 
+	// lighting types, shared by all vertices of a model which use them
+	struct material
+	{
+		float3 ambient;
+		float3 diffuse;
+		float3 emissive;
+	};
+
 	struct vertex
 	{
 		// vertex
@@ -153,10 +173,8 @@ namespace cg
 		float3 n;
 		// texture coord
 		float2 tex;
-		// lighting types
-		float3 ambient;
-		float3 diffuse;
-		float3 emissive;
+		// index in the material table of the model, 0 is the default material
+		uint32_t material_id = 0;
 	};
 
 }// namespace cg
\ No newline at end of file
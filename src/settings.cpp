@@ -15,7 +15,9 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	auto add_options = options.add_options();
 	add_options("height", "Render target height", cxxopts::value<unsigned>()->default_value("1080"));
 	add_options("width", "Render target width", cxxopts::value<unsigned>()->default_value("1920"));
+	add_options("crop", "Window of the image to ray trace as x,y,width,height, zero size for the whole image", cxxopts::value<std::vector<unsigned>>()->default_value("0,0,0,0"));
 	add_options("model_path", "Path to OBJ model", cxxopts::value<std::filesystem::path>()->default_value("..\\..\\models\\cube.obj"));
+	add_options("instances_path", "Text file with a line per instance: shape index and a row-major 3x4 transform", cxxopts::value<std::filesystem::path>()->default_value(""));
 	add_options("camera_position", "Camera position", cxxopts::value<std::vector<float>>()->default_value("0.0,1.0,5.0"));
 	add_options("camera_theta", "Camera polar angle", cxxopts::value<float>()->default_value("0.0"));
 	add_options("camera_phi", "Camera azimuth angle", cxxopts::value<float>()->default_value("0.0"));
@@ -23,8 +25,27 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	add_options("camera_z_near", "Minimum expected depth", cxxopts::value<float>()->default_value("0.001"));
 	add_options("camera_z_far", "Maximum expected depth", cxxopts::value<float>()->default_value("100.0"));
 	add_options("result_path", "Path to resulted image", cxxopts::value<std::filesystem::path>()->default_value("result.png"));
+	add_options("checkpoint_path", "Path to the accumulation checkpoint, result_path with .checkpoint extension by default", cxxopts::value<std::filesystem::path>()->default_value(""));
+	add_options("checkpoint_interval", "Frames between accumulation checkpoints, 0 disables them", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("resume", "Continue accumulation from the checkpoint if it exists", cxxopts::value<bool>()->default_value("false"));
 	add_options("raytracing_depth", "Maximum number of traces rays", cxxopts::value<unsigned>()->default_value("1"));
 	add_options("accumulation_num", "Number of accumulated frames", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("adaptive_threshold", "Relative noise at which a pixel stops sampling, 0 disables adaptive sampling", cxxopts::value<float>()->default_value("0.0"));
+	add_options("min_samples", "Samples every pixel gets before adaptive sampling may stop it", cxxopts::value<unsigned>()->default_value("4"));
+	add_options("max_samples", "Number of accumulated frames when adaptive sampling is enabled", cxxopts::value<unsigned>()->default_value("64"));
+	add_options("russian_roulette_depth", "Bounces before Russian roulette may end a path, 0 disables it", cxxopts::value<unsigned>()->default_value("3"));
+	add_options("denoise", "Filter the image guided by normals, albedo and depth of primary hits", cxxopts::value<bool>()->default_value("false"));
+	add_options("aov", "Save normal, albedo, depth, ID and sample count images next to result_path", cxxopts::value<bool>()->default_value("false"));
+	add_options("denoise_iterations", "Passes of the denoising filter, each doubles its radius", cxxopts::value<unsigned>()->default_value("5"));
+	add_options("packet_size", "Side of pixel blocks traced as ray packets: 2, 4 or 0 for single rays", cxxopts::value<unsigned>()->default_value("2"));
+	add_options("tile_size", "Side of screen tiles scheduled between threads", cxxopts::value<unsigned>()->default_value("16"));
+	add_options("wavefront", "Trace each bounce of all paths as one sorted batch", cxxopts::value<bool>()->default_value("false"));
+	add_options("seed", "Seed of the path tracer samplers, equal seeds give equal images", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("sampler", "Source of path tracer samples: sobol or random", cxxopts::value<std::string>()->default_value("sobol"));
+	add_options("bvh_bins", "Number of SAH bins per axis, 0 for an exact sweep", cxxopts::value<unsigned>()->default_value("16"));
+	add_options("bvh_max_leaf_size", "Maximum number of triangles in a BVH leaf", cxxopts::value<unsigned>()->default_value("8"));
+	add_options("bvh_cache_path", "Directory of cached acceleration structures reused by later runs, empty disables the cache", cxxopts::value<std::filesystem::path>()->default_value(""));
+	add_options("bvh_width", "BVH branching factor: 2, 4 (SSE) or 8 (AVX2)", cxxopts::value<unsigned>()->default_value("4"));
 	add_options("shader_path", "Path to a shader file", cxxopts::value<std::filesystem::path>()->default_value("..\\..\\shaders\\shaders.hlsl"));
 	add_options("h,help", "Print usage");
 
@@ -37,7 +58,12 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 
 	settings->height = result["height"].as<unsigned>();
 	settings->width = result["width"].as<unsigned>();
+	settings->crop = result["crop"].as<std::vector<unsigned>>();
+	if (settings->crop.size() != 4) {
+		THROW_ERROR("Crop window needs 4 values: x,y,width,height");
+	}
 	settings->model_path = result["model_path"].as<std::filesystem::path>();
+	settings->instances_path = result["instances_path"].as<std::filesystem::path>();
 	settings->camera_position = result["camera_position"].as<std::vector<float>>();
 	settings->camera_theta = result["camera_theta"].as<float>();
 	settings->camera_phi = result["camera_phi"].as<float>();
@@ -45,8 +71,40 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	settings->camera_z_near = result["camera_z_near"].as<float>();
 	settings->camera_z_far = result["camera_z_far"].as<float>();
 	settings->result_path = result["result_path"].as<std::filesystem::path>();
+	settings->checkpoint_path = result["checkpoint_path"].as<std::filesystem::path>();
+	if (settings->checkpoint_path.empty()) {
+		settings->checkpoint_path = settings->result_path;
+		settings->checkpoint_path.replace_extension(".checkpoint");
+	}
+	settings->checkpoint_interval = result["checkpoint_interval"].as<unsigned>();
+	settings->resume = result["resume"].as<bool>();
 	settings->raytracing_depth = result["raytracing_depth"].as<unsigned>();
 	settings->accumulation_num = result["accumulation_num"].as<unsigned>();
+	settings->adaptive_threshold = result["adaptive_threshold"].as<float>();
+	settings->min_samples = result["min_samples"].as<unsigned>();
+	settings->max_samples = result["max_samples"].as<unsigned>();
+	settings->russian_roulette_depth = result["russian_roulette_depth"].as<unsigned>();
+	settings->denoise = result["denoise"].as<bool>();
+	settings->denoise_iterations = result["denoise_iterations"].as<unsigned>();
+	settings->aov = result["aov"].as<bool>();
+	settings->packet_size = result["packet_size"].as<unsigned>();
+	if (settings->packet_size != 0 && settings->packet_size != 2 && settings->packet_size != 4) {
+		THROW_ERROR("Packet size must be 0, 2 or 4: " + std::to_string(settings->packet_size));
+	}
+	settings->tile_size = result["tile_size"].as<unsigned>();
+	settings->wavefront = result["wavefront"].as<bool>();
+	settings->seed = result["seed"].as<unsigned>();
+	settings->sampler = result["sampler"].as<std::string>();
+	if (settings->sampler != "sobol" && settings->sampler != "random") {
+		THROW_ERROR("Unknown sampler: " + settings->sampler);
+	}
+	settings->bvh_bins = result["bvh_bins"].as<unsigned>();
+	settings->bvh_max_leaf_size = result["bvh_max_leaf_size"].as<unsigned>();
+	settings->bvh_width = result["bvh_width"].as<unsigned>();
+	if (settings->bvh_width != 2 && settings->bvh_width != 4 && settings->bvh_width != 8) {
+		THROW_ERROR("BVH width must be 2, 4 or 8: " + std::to_string(settings->bvh_width));
+	}
+	settings->bvh_cache_path = result["bvh_cache_path"].as<std::filesystem::path>();
 	settings->shader_path = result["shader_path"].as<std::filesystem::path>();
 
 	return settings;
@@ -13,8 +13,12 @@ namespace cg
 
 		unsigned height;
 		unsigned width;
+		// x, y, width and height of the traced window, zero size traces the whole image
+		std::vector<unsigned> crop;
 
 		std::filesystem::path model_path;
+		// Placements of model shapes for the raytracer, empty places every shape once
+		std::filesystem::path instances_path;
 
 		std::vector<float> camera_position;
 		float camera_theta;
@@ -24,10 +28,31 @@ namespace cg
 		float camera_z_far;
 
 		std::filesystem::path result_path;
+		std::filesystem::path checkpoint_path;
+		unsigned checkpoint_interval;
+		bool resume;
 
 		unsigned raytracing_depth;
 		unsigned accumulation_num;
 
+		float adaptive_threshold;
+		unsigned min_samples;
+		unsigned max_samples;
+		unsigned russian_roulette_depth;
+		bool denoise;
+		bool aov;
+		unsigned denoise_iterations;
+		unsigned packet_size;
+		unsigned tile_size;
+		bool wavefront;
+		unsigned seed;
+		std::string sampler;
+
+		unsigned bvh_bins;
+		unsigned bvh_max_leaf_size;
+		unsigned bvh_width;
+		std::filesystem::path bvh_cache_path;
+
 		std::filesystem::path shader_path;
 	};
 
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace cg::utils
+{
+	// Splits tiles into one continuous range per thread. A thread takes tiles from its own range
+	// and, once it runs dry, steals the remaining tiles of other threads one by one
+	class tile_scheduler
+	{
+	public:
+		tile_scheduler(size_t tile_count, size_t thread_count);
+
+		// Returns false when there are no tiles left for anybody
+		bool next_tile(size_t thread_id, size_t& tile);
+
+	protected:
+		// Every range sits on its own cache line, so owners don't slow each other down
+		struct alignas(64) range
+		{
+			std::atomic<size_t> next;
+			size_t end;
+		};
+
+		bool take(range& range, size_t& tile);
+
+		std::unique_ptr<range[]> ranges;
+		size_t range_count;
+	};
+
+	inline tile_scheduler::tile_scheduler(size_t tile_count, size_t thread_count)
+	{
+		range_count = thread_count > 0 ? thread_count : 1;
+		ranges = std::make_unique<range[]>(range_count);
+		for (size_t i = 0; i < range_count; i++) {
+			ranges[i].next = tile_count * i / range_count;
+			ranges[i].end = tile_count * (i + 1) / range_count;
+		}
+	}
+
+	inline bool tile_scheduler::next_tile(size_t thread_id, size_t& tile)
+	{
+		size_t own = thread_id % range_count;
+		if (take(ranges[own], tile)) {
+			return true;
+		}
+		for (size_t i = 1; i < range_count; i++) {
+			if (take(ranges[(own + i) % range_count], tile)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	inline bool tile_scheduler::take(range& range, size_t& tile)
+	{
+		// Cheap check first, so empty ranges are not hammered by thieves
+		if (range.next.load(std::memory_order_relaxed) >= range.end) {
+			return false;
+		}
+		tile = range.next.fetch_add(1, std::memory_order_relaxed);
+		return tile < range.end;
+	}
+
+	// Position of the `code`-th cell of a Z-order curve
+	inline std::pair<uint32_t, uint32_t> morton_decode(uint32_t code)
+	{
+		auto compact = [](uint32_t value) {
+			value &= 0x55555555;
+			value = (value | (value >> 1)) & 0x33333333;
+			value = (value | (value >> 2)) & 0x0f0f0f0f;
+			value = (value | (value >> 4)) & 0x00ff00ff;
+			value = (value | (value >> 8)) & 0x0000ffff;
+			return value;
+		};
+		return {compact(code), compact(code >> 1)};
+	}
+}// namespace cg::utils
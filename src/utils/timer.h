@@ -12,6 +12,11 @@ namespace cg::utils
         {
             start = std::chrono::high_resolution_clock::now();
         }
+        // Printed next to the event, e.g. statistics of what was timed
+        void add_detail(const std::string& detail)
+        {
+            event += " (" + detail + ")";
+        }
         ~timer() 
         {
             auto stop = std::chrono::high_resolution_clock::now();
@@ -34,6 +34,7 @@ void cg::world::model::load_obj(const std::filesystem::path& model_path)
 	auto& materials = reader.GetMaterials();
 
 	allocate_buffers(shapes);
+	fill_materials(materials);
 	fill_buffers(shapes, attributes, materials, model_path.parent_path());
 }
 
@@ -101,7 +102,7 @@ float3 cg::world::model::compute_normal(const tinyobj::attrib_t& attrib, const t
 	return normalize(cross(b - a, c - a));
 }
 
-void model::fill_vertex_data(cg::vertex& vertex, const tinyobj::attrib_t& attrib, const tinyobj::index_t idx, const float3 computed_normal, const tinyobj::material_t material)
+void model::fill_vertex_data(cg::vertex& vertex, const tinyobj::attrib_t& attrib, const tinyobj::index_t idx, const float3 computed_normal, const unsigned int material_id)
 {
 	vertex.v.x = attrib.vertices[3 * idx.vertex_index];
 	vertex.v.y = attrib.vertices[3 * idx.vertex_index + 1];
@@ -120,9 +121,25 @@ void model::fill_vertex_data(cg::vertex& vertex, const tinyobj::attrib_t& attrib
 		vertex.tex.y = attrib.texcoords[2 * idx.texcoord_index + 1];
 	}
 
-	vertex.ambient = float3{material.ambient[0], material.ambient[1], material.ambient[2]};
-	vertex.diffuse = float3{material.diffuse[0], material.diffuse[1], material.diffuse[2]};
-	vertex.emissive = float3{material.emission[0], material.emission[1], material.emission[2]};
+	vertex.material_id = material_id;
+}
+
+void model::fill_materials(const std::vector<tinyobj::material_t>& obj_materials)
+{
+	// Faces without a material refer to a neutral gray one, OBJ materials follow it
+	materials.clear();
+	materials.push_back(cg::material{
+		.ambient = float3{0.5f, 0.5f, 0.5f},
+		.diffuse = float3{0.5f, 0.5f, 0.5f},
+		.emissive = float3{0.f, 0.f, 0.f},
+	});
+	for (const auto& material : obj_materials) {
+		materials.push_back(cg::material{
+			.ambient = float3{material.ambient[0], material.ambient[1], material.ambient[2]},
+			.diffuse = float3{material.diffuse[0], material.diffuse[1], material.diffuse[2]},
+			.emissive = float3{material.emission[0], material.emission[1], material.emission[2]},
+		});
+	}
 }
 
 
@@ -158,9 +175,9 @@ void model::fill_buffers(const std::vector<tinyobj::shape_t>& shapes, const tiny
 				);
 				if (index_map.count(idx_tuple) == 0) {
 					auto& vertex = vertex_buffer->item(vertex_buffer_id);
-					const auto& material = materials[mesh.material_ids[f]];
 
-					fill_vertex_data(vertex, attrib, idx, normal, material);
+					// tinyobj marks faces without a material with -1, which becomes the default one
+					fill_vertex_data(vertex, attrib, idx, normal, static_cast<unsigned int>(mesh.material_ids[f] + 1));
 
 					index_map[idx_tuple] = vertex_buffer_id;
 					vertex_buffer_id++;
@@ -171,7 +188,8 @@ void model::fill_buffers(const std::vector<tinyobj::shape_t>& shapes, const tiny
 			index_offset += fv;
 		}
 
-		if (!materials[mesh.material_ids[0]].diffuse_texname.empty()) {
+		if (!mesh.material_ids.empty() && mesh.material_ids[0] >= 0 &&
+			!materials[mesh.material_ids[0]].diffuse_texname.empty()) {
 			textures[s] = base_folder / materials[mesh.material_ids[0]].diffuse_texname;
 		}
 	}
@@ -195,6 +213,11 @@ const std::vector<std::filesystem::path>& cg::world::model::get_per_shape_textur
 	return textures;
 }
 
+const std::vector<cg::material>& cg::world::model::get_materials() const
+{
+	return materials;
+}
+
 
 const float4x4 cg::world::model::get_world_matrix() const
 {
@@ -22,6 +22,8 @@ namespace cg::world
 		const std::vector<std::shared_ptr<cg::resource<cg::vertex>>>& get_vertex_buffers() const;
 		const std::vector<std::shared_ptr<cg::resource<unsigned int>>>& get_index_buffers() const;
 		const std::vector<std::filesystem::path>& get_per_shape_texture_files() const;
+		// Indexed by `vertex::material_id`, the first entry is the default material
+		const std::vector<cg::material>& get_materials() const;
 
 		const float4x4 get_world_matrix() const;
 
@@ -30,10 +32,12 @@ namespace cg::world
 		std::vector<std::shared_ptr<cg::resource<cg::vertex>>> vertex_buffers;
 		std::vector<std::shared_ptr<cg::resource<unsigned int>>> index_buffers;
 		std::vector<std::filesystem::path> textures;
+		std::vector<cg::material> materials;
 
 		void allocate_buffers(const std::vector<tinyobj::shape_t>& shapes);
 		static float3 compute_normal(const tinyobj::attrib_t& attrib, const tinyobj::mesh_t& mesh, size_t index_offset);
-		static void fill_vertex_data(cg::vertex& vertex, const tinyobj::attrib_t& attrib, tinyobj::index_t idx, float3 computed_normal, tinyobj::material_t material);
+		static void fill_vertex_data(cg::vertex& vertex, const tinyobj::attrib_t& attrib, tinyobj::index_t idx, float3 computed_normal, unsigned int material_id);
+		void fill_materials(const std::vector<tinyobj::material_t>& obj_materials);
 		void fill_buffers(const std::vector<tinyobj::shape_t>& shapes, const tinyobj::attrib_t& attrib, const std::vector<tinyobj::material_t>& materials, const std::filesystem::path& base_folder);
 	};
 }// namespace cg::world
\ No newline at end of file